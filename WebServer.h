@@ -43,9 +43,21 @@
 // standard END-OF-LINE marker in HTTP
 #define CRLF "\r\n"
 
-// If processConnection is called without a buffer, it allocates one
-// of 32 bytes
-#define WEBDUINO_DEFAULT_REQUEST_LENGTH 32
+// Each connection keeps the URL of its request, the Authorization
+// value and the headers captured with captureHeader in an arena of
+// this many bytes.  They're put one after another as the request is
+// parsed, and all let go of at once when the next request starts.
+// Requests whose URL doesn't fit get a 414, and those whose
+// Authorization value doesn't fit a 431, without their handler being
+// run; captured headers that don't fit are cut short or left empty.
+// The method and header names are checked in it too, after what it
+// keeps, so there has to be room for them as well.  The default has
+// room for the 32 byte URL buffer and the credentials this used to
+// keep; apps that take longer URLs, such as forms sent with GET, need
+// a bigger arena.
+#ifndef WEBDUINO_ARENA_SIZE
+#define WEBDUINO_ARENA_SIZE 128
+#endif
 
 // How long to wait before considering a connection as dead when
 // reading the HTTP request.  Used to avoid DOS attacks.
@@ -53,14 +65,279 @@
 #define WEBDUINO_READ_TIMEOUT_IN_MS 1000
 #endif
 
+// add "#define WEBDUINO_NONBLOCKING 1" to your application before
+// including WebServer.h to have processConnection parse requests
+// incrementally.  Each call then only consumes the bytes that have
+// already arrived and returns right away; the command handler is run
+// on the call that completes the request.
+#ifndef WEBDUINO_NONBLOCKING
+#define WEBDUINO_NONBLOCKING 0
+#endif
+
+// In non-blocking mode, a command handler for a request with a body is
+// run once the whole body has arrived, or once at least this many
+// bytes of it are waiting in the socket.  Anything past that is read
+// by the handler with the usual blocking read().
+#ifndef WEBDUINO_NONBLOCKING_BODY_SIZE
+#define WEBDUINO_NONBLOCKING_BODY_SIZE 1024
+#endif
+
+// In non-blocking mode, new clients are taken with
+// EthernetServer::accept() where the Ethernet library has it, as
+// version 2.0 and later do.  Older versions only have available(),
+// which keeps reporting the socket of a client already being served,
+// so the sockets behind it are looked at through the library's
+// internals.  Define this as 0 or 1 if the version isn't told apart
+// right.
+#ifndef WEBDUINO_ETHERNET_ACCEPT
+#ifdef ethernet_h_
+#define WEBDUINO_ETHERNET_ACCEPT 1
+#else
+#define WEBDUINO_ETHERNET_ACCEPT 0
+#endif
+#endif
+
+// add "#define WEBDUINO_KEEP_ALIVE 1" to your application before
+// including WebServer.h to answer in HTTP/1.1 and keep connections
+// open for further requests when the client asks for it.  This needs
+// the non-blocking mode.  A connection is only kept open if the
+// length of the response is known, so pass it to httpSuccess when you
+// can.
+#ifndef WEBDUINO_KEEP_ALIVE
+#define WEBDUINO_KEEP_ALIVE 0
+#endif
+#if WEBDUINO_KEEP_ALIVE && !WEBDUINO_NONBLOCKING
+#error "WEBDUINO_KEEP_ALIVE needs WEBDUINO_NONBLOCKING"
+#endif
+
+// How long an open connection may sit idle between two requests, and
+// how many requests it may carry before it's closed anyway.
+#ifndef WEBDUINO_KEEP_ALIVE_TIMEOUT_IN_MS
+#define WEBDUINO_KEEP_ALIVE_TIMEOUT_IN_MS 2000
+#endif
+
+#ifndef WEBDUINO_KEEP_ALIVE_MAX_REQUESTS
+#define WEBDUINO_KEEP_ALIVE_MAX_REQUESTS 20
+#endif
+
+// In keep-alive mode, responses whose length isn't known up front are
+// sent to HTTP/1.1 clients with chunked transfer-encoding, so the
+// connection can stay open after them.  Each flush of the output
+// buffer becomes one chunk.  Define this as 0 to close the connection
+// after such responses instead.
+#ifndef WEBDUINO_CHUNKED_ENCODING
+#define WEBDUINO_CHUNKED_ENCODING WEBDUINO_KEEP_ALIVE
+#endif
+#if WEBDUINO_CHUNKED_ENCODING && !WEBDUINO_KEEP_ALIVE
+#error "WEBDUINO_CHUNKED_ENCODING needs WEBDUINO_KEEP_ALIVE"
+#endif
+
+// How many clients can be served at the same time.  Only the
+// non-blocking mode can work on more than one request at a time, and
+// by default it uses as many slots as the Ethernet chip has sockets.
+// Each slot costs the size of its input and output buffers in RAM.
+#ifndef WEBDUINO_MAX_CONNECTIONS
+#if WEBDUINO_NONBLOCKING && defined(MAX_SOCK_NUM)
+#define WEBDUINO_MAX_CONNECTIONS MAX_SOCK_NUM
+#else
+#define WEBDUINO_MAX_CONNECTIONS 1
+#endif
+#endif
+
+// add "#define WEBDUINO_EVENT_STREAMS 2" (or how many you need) to
+// your application before including WebServer.h to let command
+// handlers turn their connection into a stream of Server-Sent Events
+// with startEventStream, for sendEvent to push events to.  This needs
+// WEBDUINO_NONBLOCKING.  Each open stream holds one of the Ethernet
+// chip's sockets until its client goes away.  Streams that have been
+// quiet for WEBDUINO_EVENT_HEARTBEAT_IN_MS get a comment line, so dead
+// clients are found out and proxies don't give up on live ones.
+#ifndef WEBDUINO_EVENT_STREAMS
+#define WEBDUINO_EVENT_STREAMS 0
+#endif
+
+#ifndef WEBDUINO_EVENT_HEARTBEAT_IN_MS
+#define WEBDUINO_EVENT_HEARTBEAT_IN_MS 15000
+#endif
+
+// sendEvent puts events together in blocks of this size, on the stack,
+// and sends each to the streams as it fills
+#ifndef WEBDUINO_EVENT_BLOCK_SIZE
+#define WEBDUINO_EVENT_BLOCK_SIZE 64
+#endif
+
+// add "#define WEBDUINO_WEBSOCKETS 2" (or how many you need) to your
+// application before including WebServer.h to let command handlers
+// accept requests to upgrade to a WebSocket with startWebSocket.  The
+// messages that come in on it are then passed to a handler of their
+// own, and sendWebSocket answers on it without a new request.  This
+// needs WEBDUINO_NONBLOCKING.  Each open WebSocket holds one of the
+// Ethernet chip's sockets, and a buffer of
+// WEBDUINO_WEBSOCKET_MESSAGE_SIZE bytes for the message coming in,
+// with WEBDUINO_WEBSOCKET_CONTROL_SIZE more for a ping or close that
+// comes in the middle of it; bigger messages close it.  WebSockets
+// that have been quiet for WEBDUINO_WEBSOCKET_PING_IN_MS get a ping.
+#ifndef WEBDUINO_WEBSOCKETS
+#define WEBDUINO_WEBSOCKETS 0
+#endif
+
+#ifndef WEBDUINO_WEBSOCKET_MESSAGE_SIZE
+#define WEBDUINO_WEBSOCKET_MESSAGE_SIZE 64
+#endif
+
+// control frames can't be longer than 125 bytes
+#ifndef WEBDUINO_WEBSOCKET_CONTROL_SIZE
+#define WEBDUINO_WEBSOCKET_CONTROL_SIZE 125
+#endif
+
+#ifndef WEBDUINO_WEBSOCKET_PING_IN_MS
+#define WEBDUINO_WEBSOCKET_PING_IN_MS 15000
+#endif
+
+// frames are sent with their header and as much of their payload as
+// fits in a block of this size, on the stack; the rest goes straight
+// from where it is
+#ifndef WEBDUINO_WEBSOCKET_BLOCK_SIZE
+#define WEBDUINO_WEBSOCKET_BLOCK_SIZE 32
+#endif
+
 #ifndef WEBDUINO_COMMANDS_COUNT
 #define WEBDUINO_COMMANDS_COUNT 8
 #endif
 
+// Longest verb, including the terminating NUL, that fits in an entry
+// of a route table set with setRoutes.
+#ifndef WEBDUINO_ROUTE_VERB_LENGTH
+#define WEBDUINO_ROUTE_VERB_LENGTH 16
+#endif
+
 #ifndef WEBDUINO_URL_PATH_COMMAND_LENGTH
 #define WEBDUINO_URL_PATH_COMMAND_LENGTH 8
 #endif
 
+// How many headers the application can have captured with
+// captureHeader.  0 leaves header capture out, and the RAM it takes in
+// each connection.
+#ifndef WEBDUINO_CAPTURE_HEADERS_COUNT
+#define WEBDUINO_CAPTURE_HEADERS_COUNT 4
+#endif
+
+// The longest header name the request parser checks against the
+// header its hash points to.  Headers with longer names are never
+// recognised or captured.  Names are collected in the arena for the
+// check, after what it keeps; those that find it full are left out,
+// and a request whose Content-Length or Authorization is gets a 431.
+#ifndef WEBDUINO_HEADER_NAME_LENGTH
+#define WEBDUINO_HEADER_NAME_LENGTH 24
+#endif
+
+// add "#define WEBDUINO_CONDITIONAL_REQUESTS 0" to your application
+// before including WebServer.h to ignore If-None-Match,
+// If-Modified-Since, Range and If-Range, which saves 21 bytes of RAM
+// for each connection.  notModified and range then always return
+// false, and the ETag and Last-Modified headers are still sent.
+#ifndef WEBDUINO_CONDITIONAL_REQUESTS
+#define WEBDUINO_CONDITIONAL_REQUESTS 1
+#endif
+
+// Files served with serveFiles are sent in blocks of this size,
+// straight from a buffer on the stack to the socket.  The bigger, the
+// fewer reads and writes a file takes, but it has to fit on the stack
+// next to whatever the storage library needs.
+#ifndef WEBDUINO_FILE_BLOCK_SIZE
+#define WEBDUINO_FILE_BLOCK_SIZE 256
+#endif
+
+// Longest path of a file served with serveFiles, including the
+// terminating NUL, and the file sent for a URL naming a directory.
+#ifndef WEBDUINO_FILE_PATH_LENGTH
+#define WEBDUINO_FILE_PATH_LENGTH 64
+#endif
+
+#ifndef WEBDUINO_FILE_INDEX
+#define WEBDUINO_FILE_INDEX "index.htm"
+#endif
+
+// add "#define WEBDUINO_MULTIPART 1" to your application before
+// including WebServer.h to have readMultipart, for forms that upload
+// files.  It costs the boundary of the request body, up to 70
+// characters, in RAM for each connection.
+#ifndef WEBDUINO_MULTIPART
+#define WEBDUINO_MULTIPART 0
+#endif
+
+// readMultipart reads the body in blocks of this size, on the stack,
+// and hands the header lines of each part over in a buffer of this
+// size, also on the stack; longer lines are cut short.
+#ifndef WEBDUINO_MULTIPART_BLOCK_SIZE
+#define WEBDUINO_MULTIPART_BLOCK_SIZE 64
+#endif
+
+#ifndef WEBDUINO_MULTIPART_HEADER_LENGTH
+#define WEBDUINO_MULTIPART_HEADER_LENGTH 96
+#endif
+
+// readJson keeps track of objects and arrays nested up to this deep,
+// and hands over paths and values of up to these lengths, including
+// the terminating NUL; longer values are cut short, and values with
+// longer paths are left out.
+#ifndef WEBDUINO_JSON_DEPTH
+#define WEBDUINO_JSON_DEPTH 8
+#endif
+
+#ifndef WEBDUINO_JSON_PATH_LENGTH
+#define WEBDUINO_JSON_PATH_LENGTH 48
+#endif
+
+#ifndef WEBDUINO_JSON_VALUE_LENGTH
+#define WEBDUINO_JSON_VALUE_LENGTH 32
+#endif
+
+// readJson reads the body in blocks of this size, on the stack
+#ifndef WEBDUINO_JSON_BLOCK_SIZE
+#define WEBDUINO_JSON_BLOCK_SIZE 32
+#endif
+
+// add "#define WEBDUINO_METRICS 1" to your application before
+// including WebServer.h to have the server count the requests to each
+// route, the bytes they take in and send out, how many fail and how
+// long they take, and serve the counts at WEBDUINO_METRICS_PATH in the
+// text format Prometheus scrapes.  Each of the WEBDUINO_METRICS_ROUTES
+// routes kept apart costs about 80 bytes of RAM; requests to any
+// further route, or to none, are counted together as "(other)".
+#ifndef WEBDUINO_METRICS
+#define WEBDUINO_METRICS 0
+#endif
+
+#ifndef WEBDUINO_METRICS_ROUTES
+#define WEBDUINO_METRICS_ROUTES 8
+#endif
+
+#ifndef WEBDUINO_METRICS_PATH
+#define WEBDUINO_METRICS_PATH "/metrics"
+#endif
+
+// how long requests take is sorted into this many buckets, for up to
+// 1 ms, 2 ms, 4 ms and so on, and one for those that take longer
+#ifndef WEBDUINO_METRICS_BUCKETS
+#define WEBDUINO_METRICS_BUCKETS 12
+#endif
+
+// add "#define WEBDUINO_RESPONSE_CACHE 1024" (or any number of bytes)
+// to your application before including WebServer.h to set that much
+// RAM aside for responses kept with cacheResponse.  Up to
+// WEBDUINO_RESPONSE_CACHE_ENTRIES of them are kept at once; the oldest
+// make room for new ones.  A kept response is sent without calling
+// the handler, to requests for the same URL with the same
+// Authorization value.
+#ifndef WEBDUINO_RESPONSE_CACHE
+#define WEBDUINO_RESPONSE_CACHE 0
+#endif
+
+#ifndef WEBDUINO_RESPONSE_CACHE_ENTRIES
+#define WEBDUINO_RESPONSE_CACHE_ENTRIES 4
+#endif
+
 #ifndef WEBDUINO_FAIL_MESSAGE
 #define WEBDUINO_FAIL_MESSAGE "<h1>EPIC FAIL</h1>"
 #endif
@@ -77,10 +354,69 @@
 #define WEBDUINO_SERVER_ERROR_MESSAGE "<h1>500 Internal Server Error</h1>"
 #endif // WEBDUINO_SERVER_ERROR_MESSAGE
 
+// Output is collected in a buffer of this size and sent when it fills
+// up, when flush() is called or when the response is done, so the
+// fewer TCP segments a response takes the bigger it is.  It may be
+// up to 65535 bytes; 2048, one W5100 transmit buffer, lets most pages
+// go out in one or two segments if there is RAM to spare.
 #ifndef WEBDUINO_OUTPUT_BUFFER_SIZE
 #define WEBDUINO_OUTPUT_BUFFER_SIZE 32
 #endif // WEBDUINO_OUTPUT_BUFFER_SIZE
 
+// Bytes are fetched from the socket in blocks of up to this size,
+// since each read from the Ethernet chip costs several SPI transfers
+// no matter how much it reads.  Each connection has such a buffer; 0
+// reads a byte at a time instead, which saves the RAM.
+#ifndef WEBDUINO_INPUT_BUFFER_SIZE
+#define WEBDUINO_INPUT_BUFFER_SIZE 32
+#endif // WEBDUINO_INPUT_BUFFER_SIZE
+
+#if WEBDUINO_OUTPUT_BUFFER_SIZE > 65535
+#error "WEBDUINO_OUTPUT_BUFFER_SIZE can't be over 65535"
+#endif
+
+#if WEBDUINO_ARENA_SIZE < 16 || WEBDUINO_ARENA_SIZE > 65535
+#error "WEBDUINO_ARENA_SIZE must be between 16 and 65535"
+#endif
+
+#if WEBDUINO_CHUNKED_ENCODING && WEBDUINO_OUTPUT_BUFFER_SIZE < 16
+#error "WEBDUINO_OUTPUT_BUFFER_SIZE is too small for chunked responses"
+#endif
+
+#if WEBDUINO_WEBSOCKET_BLOCK_SIZE < 16
+#error "WEBDUINO_WEBSOCKET_BLOCK_SIZE is too small for WebSocket frames"
+#endif
+
+#if WEBDUINO_WEBSOCKET_MESSAGE_SIZE > 65534
+#error "WEBDUINO_WEBSOCKET_MESSAGE_SIZE can't be over 65534"
+#endif
+
+#if WEBDUINO_WEBSOCKET_CONTROL_SIZE < 2 || WEBDUINO_WEBSOCKET_CONTROL_SIZE > 125
+#error "WEBDUINO_WEBSOCKET_CONTROL_SIZE must be between 2 and 125"
+#endif
+
+#if WEBDUINO_HEADER_NAME_LENGTH < 17 || WEBDUINO_HEADER_NAME_LENGTH > 254
+#error "WEBDUINO_HEADER_NAME_LENGTH has to be between 17 and 254"
+#endif
+
+#if WEBDUINO_RESPONSE_CACHE > 65535
+#error "WEBDUINO_RESPONSE_CACHE can't be over 65535"
+#endif
+
+// only the non-blocking mode tells the sockets it took over apart from
+// new clients
+#if WEBDUINO_EVENT_STREAMS && !WEBDUINO_NONBLOCKING
+#error "WEBDUINO_EVENT_STREAMS needs WEBDUINO_NONBLOCKING"
+#endif
+
+#if WEBDUINO_WEBSOCKETS && !WEBDUINO_NONBLOCKING
+#error "WEBDUINO_WEBSOCKETS needs WEBDUINO_NONBLOCKING"
+#endif
+
+#if WEBDUINO_METRICS && WEBDUINO_METRICS_ROUTES < 2
+#error "WEBDUINO_METRICS_ROUTES needs room for at least one route and the rest"
+#endif
+
 // add '#define WEBDUINO_FAVICON_DATA ""' to your application
 // before including WebServer.h to send a null file as the favicon.ico file
 // otherwise this defaults to a 16x16 px black diode on blue ground
@@ -142,7 +478,54 @@ extern "C" unsigned long millis(void);
 
 #ifdef _VARIANT_ARDUINO_DUE_X_
 #define pgm_read_byte(ptr) (unsigned char)(* ptr)
+#ifndef pgm_read_word
+#define pgm_read_word(ptr) (* (const uint16_t *)(ptr))
+#endif
+#ifndef pgm_read_dword
+#define pgm_read_dword(ptr) (* (const uint32_t *)(ptr))
+#endif
+#ifndef pgm_read_ptr
+#define pgm_read_ptr(ptr) (* (void * const *)(ptr))
+#endif
+#ifndef strncmp_P
+#define strncmp_P(s1, s2, n) strncmp((s1), (s2), (n))
+#endif
+#ifndef memcpy_P
+#define memcpy_P(dest, src, n) memcpy((dest), (src), (n))
+#endif
+#ifndef strnlen_P
+#define strnlen_P(s, n) strnlen((const char *)(s), (n))
+#endif
+#ifndef strcasecmp_P
+#define strcasecmp_P(s1, s2) strcasecmp((s1), (s2))
+#endif
+#ifndef strcmp_P
+#define strcmp_P(s1, s2) strcmp((s1), (s2))
+#endif
+#ifndef PSTR
+#define PSTR(s) (s)
+#endif
+#endif
+
+// older avr-libc versions lack this one
+#if defined(__AVR__) && !defined(pgm_read_ptr)
+#define pgm_read_ptr(ptr) ((void *)pgm_read_word(ptr))
 #endif
+
+// check at compile time that a route table for setRoutes, or an asset
+// table for setAssets, is sorted
+#define WEBDUINO_ROUTES_SORTED(routes) \
+  static_assert(WebServer::routesSorted(routes, SIZE(routes)), \
+                #routes " must be sorted by verb and without duplicates")
+
+// declare a template like P does, along with nameSlots, a table of
+// where its placeholders are worked out by the compiler.  Pass both to
+// renderTemplate so it needn't look at each byte of the text.
+#define WEBDUINO_TEMPLATE(name, text) \
+  static_assert(sizeof(text) <= 65535, #name " is too long"); \
+  P(name) = text; \
+  static constexpr auto name##Slots PROGMEM = WebServer::templateSlots< \
+    WebServer::templateCount(text, sizeof(text) - 1)>(text, sizeof(text) - 1)
 /********************************************************************
  * DECLARATIONS
  ********************************************************************/
@@ -168,8 +551,9 @@ public:
   // this prototype.
   // url_tail contains the part of the URL that wasn't matched against
   //          the registered command table.
-  // tail_complete is true if the complete URL fit in url_tail,  false if
-  //          part of it was lost because the buffer was too small.
+  // tail_complete is true if the complete URL fit in url_tail.  Requests
+  //          with URLs too long for the arena are answered with a 414
+  //          instead, so it's always true now.
   typedef void Command(WebServer &server, ConnectionType type,
                        char *url_tail, bool tail_complete);
 
@@ -188,14 +572,18 @@ public:
 
   // check for an incoming connection, and if it exists, process it
   // by reading its request and calling the appropriate command
-  // handler.  This version is for compatibility with apps written for
-  // version 1.1,  and allocates the URL "tail" buffer internally.
+  // handler.  The URL "tail" handed to the handler is kept in the
+  // connection's arena, see WEBDUINO_ARENA_SIZE.
   void processConnection();
 
-  // check for an incoming connection, and if it exists, process it
-  // by reading its request and calling the appropriate command
-  // handler.  This version saves the "tail" of the URL in buff.
-  void processConnection(char *buff, int *bufflen);
+  // the same, for apps written when the URL went in a buffer of
+  // their own.  buff and bufflen aren't used anymore: URLs longer than
+  // the arena get a 414 however big buff is, so calling this gives a
+  // warning to call processConnection() and set WEBDUINO_ARENA_SIZE
+  // instead.
+  void processConnection(char *buff, int *bufflen)
+    __attribute__((deprecated("buff isn't used; call processConnection() "
+                              "and set WEBDUINO_ARENA_SIZE instead")));
 
   // set command that's run when you access the root of the server
   void setDefaultCommand(Command *cmd);
@@ -206,6 +594,95 @@ public:
   // add a new command to be run at the URL specified by verb
   void addCommand(const char *verb, Command *cmd);
 
+  // an entry of a route table.  The verb is kept in the entry itself,
+  // so a table declared with PROGMEM doesn't use any RAM.
+  struct Route
+  {
+    char verb[WEBDUINO_ROUTE_VERB_LENGTH];
+    Command *cmd;
+  };
+
+  // set a table of commands to be run at the URLs specified by their
+  // verbs, in addition to those added with addCommand.  The table must
+  // be stored in program memory and sorted by verb, so it can be
+  // searched without walking all of it; put
+  // WEBDUINO_ROUTES_SORTED(routes) after it (with the table declared
+  // constexpr) to have the compiler check.
+  void setRoutes(const Route *routes, uint8_t count);
+
+  // a file kept in program memory, like a script or a style sheet.  It
+  // is stored compressed with gzip, and can also be stored as is for
+  // the rare client that doesn't accept gzip; without that copy, those
+  // get the compressed one anyway.  The content type has to be in
+  // program memory as well, e.g. defined with the P macro.
+  struct Asset
+  {
+    char verb[WEBDUINO_ROUTE_VERB_LENGTH];
+    const unsigned char *contentType;
+    const unsigned char *gzipData;
+    size_t gzipLength;
+    const unsigned char *data;
+    size_t length;
+    // a hash of the data worked out when building it, or 0
+    uint32_t etag;
+  };
+
+  // set a table of assets to be sent for GET and HEAD requests of the
+  // URLs specified by their verbs.  Like the route table, it must be
+  // stored in program memory and sorted by verb.
+  void setAssets(const Asset *assets, uint8_t count);
+
+  // send an asset from a table in program memory as the response,
+  // compressed if the client accepts that
+  void sendAsset(ConnectionType type, const Asset *asset);
+
+  // where files served with serveFiles come from.  Only one file is
+  // open at a time.
+  class FileStore
+  {
+  public:
+    // open the file at path, relative to the root of the store, for
+    // reading; returns false if there's no such file
+    virtual bool open(const char *path) = 0;
+    virtual void close() = 0;
+
+    // size of the open file
+    virtual uint32_t size() = 0;
+
+    // time of the last change of the open file in seconds since 1970,
+    // or 0 if the store can't tell
+    virtual uint32_t lastModified() { return 0; }
+
+    // move to pos bytes from the start of the open file
+    virtual bool seek(uint32_t pos) = 0;
+
+    // read up to len bytes; returns how many were read
+    virtual int read(uint8_t *buffer, uint16_t len) = 0;
+  };
+
+  // serve the files of store for GET and HEAD requests of URLs below
+  // prefix, e.g. "files" for /files/log.txt, or "" for all URLs that
+  // aren't handled otherwise
+  void serveFiles(const char *prefix, FileStore *store);
+
+  // send the file at path from store as the response; returns false,
+  // without sending anything, if there's no such file
+  bool sendFile(ConnectionType type, FileStore *store, const char *path);
+
+  // used by WEBDUINO_ROUTES_SORTED
+  static constexpr int routeCompare(const char *a, const char *b)
+  {
+    return (*a != *b || *a == 0) ? (uint8_t)*a - (uint8_t)*b
+                                 : routeCompare(a + 1, b + 1);
+  }
+  template<class T>
+  static constexpr bool routesSorted(const T *routes, unsigned count)
+  {
+    return count < 2 ||
+      (routeCompare(routes[0].verb, routes[1].verb) < 0 &&
+       routesSorted(routes + 1, count - 1));
+  }
+
   // Set command that's run if default command or URL specified commands do
   // not run, uses extra url_path parameter to allow resolving the URL in the
   // function.
@@ -221,15 +698,176 @@ public:
   // inline overload for printP to handle signed char strings
   void printP(const char *str) { printP((unsigned char*)str); }
 
-  // support for C style formating
-  void printf(char *fmt, ... );
+  // output a string stored in program memory whose length is already
+  // known, e.g. sizeof(str) - 1 for one defined with the P macro, which
+  // saves looking for its end
+  void printP(const unsigned char *str, size_t length) { writeP(str, length); }
+  void printP(const char *str, size_t length) { writeP((const unsigned char*)str, length); }
+
+  // support for C style formating, written straight to the output
+  // buffer so there's no limit on the length.  It knows the flags -
+  // and 0, a width, a precision and the l modifier, with the
+  // conversions d i u x X c s f % and S for a string in PROGMEM.  %f
+  // is only good for numbers below 4294967296 and 9 decimals.  A NULL
+  // string comes out as (null).
+  void printf(const char *fmt, ... );
   #ifdef F
   void printf(const __FlashStringHelper *format, ... );
   #endif
 
+  // output numbers without going through the generic conversion of
+  // Print.  printHex writes at least digits digits, with leading zeros,
+  // and printFixed moves the decimal point left by decimals places (up
+  // to 9), so printFixed(-5, 2) writes -0.05
+  void printInt(long number);
+  void printUInt(unsigned long number);
+  void printHex(unsigned long number, uint8_t digits = 0);
+  void printFixed(long number, uint8_t decimals);
+
+  // called by renderTemplate for each {{name}} placeholder, to output
+  // what goes in its place.  slot is WebServer::slot(name), which can
+  // be used as a case label as it's worked out by the compiler.
+  typedef void TemplateCommand(WebServer &server, uint32_t slot);
+
+  // output a template stored in program memory, like one defined with
+  // the P macro.  The text between the placeholders is written in
+  // whole runs, and cmd is called for each placeholder:
+  //
+  //   P(page) = "<p>Up for {{uptime}} s</p>";
+  //   void pageSlot(WebServer &server, uint32_t slot)
+  //   {
+  //     if (slot == WebServer::slot("uptime"))
+  //       server.printUInt(millis() / 1000);
+  //   }
+  //   ...
+  //   server.renderTemplate(page, &pageSlot);
+  //
+  // This reads each byte of the template twice, once looking for
+  // placeholders and once writing it out.  Declare the template with
+  // WEBDUINO_TEMPLATE instead of P to have the compiler find them:
+  //
+  //   WEBDUINO_TEMPLATE(page, "<p>Up for {{uptime}} s</p>");
+  //   ...
+  //   server.renderTemplate(page, pageSlots, &pageSlot);
+  void renderTemplate(const unsigned char *tpl, TemplateCommand *cmd);
+
+  // where a placeholder is in its template, and its slot number
+  struct TemplateSlot
+  {
+    uint16_t start;   // the opening braces
+    uint16_t end;     // just past the closing braces
+    uint32_t slot;
+  };
+  // the placeholders of a template, as made by WEBDUINO_TEMPLATE.  The
+  // last entry has the end of the template as both start and end.
+  template<unsigned N>
+  struct TemplateSlots
+  {
+    TemplateSlot entry[N];
+  };
+
+  // output a template declared with WEBDUINO_TEMPLATE
+  template<unsigned N>
+  void renderTemplate(const unsigned char *tpl, const TemplateSlots<N> &slots,
+                      TemplateCommand *cmd)
+  {
+    renderSlots(tpl, slots.entry, cmd);
+  }
+
+  // the slot number of the placeholder {{name}}; spaces and case in
+  // the placeholder don't matter
+  static constexpr uint32_t slot(const char *name)
+  {
+    return hashName(name);
+  }
+
+  // used by WEBDUINO_TEMPLATE, and find placeholders the way
+  // renderTemplate does.  templateFind looks for a pair of braces
+  // between from and to, returning to if there's none; it splits the
+  // text in halves as the compiler limits how deep calls may nest, and
+  // stops at the first pair it finds.
+  static constexpr unsigned templateFind(const char *t, char brace,
+                                         unsigned from, unsigned to)
+  {
+    return to - from < 2
+      ? ((from < to && t[from] == brace && t[from + 1] == brace) ? from : to)
+      : templateFindOn(t, brace,
+                       templateFind(t, brace, from, from + (to - from) / 2),
+                       from + (to - from) / 2, to);
+  }
+  static constexpr unsigned templateFindOn(const char *t, char brace,
+                                           unsigned found, unsigned middle,
+                                           unsigned to)
+  {
+    return found != middle ? found : templateFind(t, brace, middle, to);
+  }
+  // where the placeholder opened at open is closed; len if it isn't,
+  // which makes the rest of the template text
+  static constexpr unsigned templateClose(const char *t, unsigned len,
+                                          unsigned open)
+  {
+    return open == len ? len : templateFind(t, '}', open + 2, len);
+  }
+  static constexpr unsigned templateCount(const char *t, unsigned len,
+                                          unsigned from = 0)
+  {
+    return templateCountTo(t, len,
+                           templateClose(t, len, templateFind(t, '{', from, len)));
+  }
+  static constexpr unsigned templateCountTo(const char *t, unsigned len,
+                                            unsigned close)
+  {
+    return close == len ? 0 : 1 + templateCount(t, len, close + 2);
+  }
+  static constexpr uint32_t templateHash(const char *t, unsigned from,
+                                         unsigned to, uint32_t hash = HASH_START)
+  {
+    return from == to ? hash
+      : templateHash(t, from + 1, to, t[from] == ' ' ? hash
+                     : hashChar(hash, lowerCase(t[from])));
+  }
+  static constexpr TemplateSlot templateSlot(const char *t, unsigned len,
+                                             unsigned open)
+  {
+    return TemplateSlot{ (uint16_t)open,
+                         (uint16_t)(templateClose(t, len, open) + 2),
+                         templateHash(t, open + 2, templateClose(t, len, open)) };
+  }
+  // the table is built up one placeholder at a time, with left the
+  // number still to be found
+  template<unsigned N> struct TemplateLeft {};
+  template<unsigned N>
+  static constexpr TemplateSlots<N + 1> templateSlots(const char *t, unsigned len)
+  {
+    return templateSlots<N + 1>(t, len, templateFind(t, '{', 0, len),
+                                TemplateLeft<N>());
+  }
+  template<unsigned N, unsigned L, class... S>
+  static constexpr TemplateSlots<N> templateSlots(const char *t, unsigned len,
+                                                  unsigned open, TemplateLeft<L>,
+                                                  S... found)
+  {
+    return templateSlots<N>(t, len,
+                            templateFind(t, '{', templateClose(t, len, open) + 2, len),
+                            TemplateLeft<L - 1>(), found...,
+                            templateSlot(t, len, open));
+  }
+  template<unsigned N, class... S>
+  static constexpr TemplateSlots<N> templateSlots(const char *, unsigned len,
+                                                  unsigned, TemplateLeft<0>,
+                                                  S... found)
+  {
+    return TemplateSlots<N>{{ found...,
+                              TemplateSlot{ (uint16_t)len, (uint16_t)len, 0 } }};
+  }
+
   // output raw data stored in program memory
   void writeP(const unsigned char *data, size_t length);
 
+  // send what has been output so far right away instead of waiting
+  // for the buffer to fill or the response to end
+  void flush();
+
   // output HTML for a radio button
   void radioButton(const char *name, const char *val,
                    const char *label, bool selected);
@@ -241,6 +879,16 @@ public:
   // returns next character or -1 if we're at end-of-stream
   int read();
 
+  // reads up to length bytes of the request into buffer, stopping at
+  // the end of the content like read() does.  Use this to get at large
+  // PUT/POST bodies in blocks rather than one character at a time.
+  //
+  // returns the number of bytes read, which is less than length only
+  // at end-of-stream
+  size_t readBytes(uint8_t *buffer, size_t length);
+  size_t readBytes(char *buffer, size_t length)
+    { return readBytes((uint8_t*)buffer, length); }
+
   // put a character that's been read back into the input pool
   void push(int ch);
 
@@ -258,6 +906,17 @@ public:
   // from the server stream
   void readHeader(char *value, int valueLen);
 
+  // have the value of the header called name (in any case) kept in
+  // the connection's arena while the request is read, for the command
+  // handlers.  Call it before begin.  name has to stay around, like a
+  // string literal, and be at most WEBDUINO_HEADER_NAME_LENGTH long.
+  void captureHeader(const char *name);
+
+  // value of a header registered with captureHeader in the request
+  // being handled, "" if the request didn't have it, or NULL if the
+  // header isn't registered
+  const char *header(const char *name);
+
   // Read the next keyword parameter from the socket.  Assumes that other
   // code has already skipped over the headers,  and the next thing to
   // be read will be the start of a keyword.
@@ -265,13 +924,83 @@ public:
   // returns true if we're not at end-of-stream
   bool readPOSTparam(char *name, int nameLen, char *value, int valueLen);
 
-  // Read the next keyword parameter from the buffer filled by getRequest.
+#if WEBDUINO_MULTIPART
+  enum MultipartEvent { MULTIPART_HEADER, MULTIPART_DATA, MULTIPART_END };
+
+  // called by readMultipart for each header line of a part, like
+  // "Content-Disposition: form-data; name=\"file\"; filename=\"a.txt\"",
+  // with data NUL-terminated; then for each piece of the part's data,
+  // as it comes in; and with no data at the end of the part
+  typedef void MultipartCommand(WebServer &server, MultipartEvent event,
+                                const char *data, size_t length);
+
+  // Read a multipart/form-data body, as sent by forms with
+  // enctype="multipart/form-data", handing its parts to cmd.  No part
+  // is kept in memory as a whole, so uploads can go straight to a file
+  // of any size.
+  //
+  // returns false if the body isn't multipart or ends too early
+  bool readMultipart(MultipartCommand *cmd);
+#endif
+
+  enum JsonType { JSON_STRING, JSON_NUMBER, JSON_BOOLEAN, JSON_NULL };
+
+  // called by readJson for each string, number, true, false or null in
+  // the body, with where it is, like "leds[2].color", and its text;
+  // strings are unescaped and without the quotes
+  typedef void JsonCommand(WebServer &server, const char *path,
+                           JsonType type, const char *value);
+
+  // Read a JSON document from the request body as it comes in, handing
+  // each value in it to cmd.  The body isn't kept in memory, so its
+  // size doesn't matter.
+  //
+  // returns false if the body isn't valid JSON or is nested too deep
+  bool readJson(JsonCommand *cmd);
+
+  // find the parameter param, like name or filename, in a header value
+  // of the form "value; param=value; param=\"value\"", and copy its
+  // value without the quotes.
+  //
+  // returns false if it isn't there
+  static bool headerParam(const char *header, const char *param,
+                          char *value, int valueLen);
+
+  // Read the next keyword parameter from the URL tail passed to a command.
   //
   // returns 0 if everything weent okay,  non-zero if not
   // (see the typedef for codes)
   URLPARAM_RESULT nextURLparam(char **tail, char *name, int nameLen,
                                char *value, int valueLen);
 
+  // a parameter of a URL tail, decoded where it is in the tail
+  struct URLParam
+  {
+    char *name;
+    char *value;
+    size_t nameLength;
+    size_t valueLength;
+  };
+
+  // Read the next parameter from the URL tail passed to a command
+  // without copying it.  Its %xx escapes and + are decoded in place,
+  // the name and value are NUL terminated there and param points at
+  // them, so there's no buffer to size and nothing is cut short.  The
+  // lengths tell if a %00 ended them early.
+  //
+  // returns false once there are no parameters left
+  static bool nextURLparam(char **tail, URLParam &param);
+
+  // Find the parameter called name in the URL tail passed to a command
+  // and decode its value in place.  The value isn't NUL terminated, but
+  // it's followed by the '&' of the next parameter or the end of the
+  // tail, so strtoul and the like can use it as it is.  Only this value
+  // changes, so the parameters can be looked up in any order, each once.
+  //
+  // returns the value, with its length in *length, or NULL if the
+  // parameter isn't there
+  static char *findParam(char *tail, const char *name, size_t *length = NULL);
+
   // compare string against credentials in current request
   //
   // authCredentials must be Base64 encoded outside of Webduino
@@ -292,11 +1021,103 @@ public:
   // output headers indicating "204 No Content" and no further message
   void httpNoContent();
 
+  // output headers indicating "304 Not Modified" and no further message
+  void httpNotModified();
+
+  // declare the ETag and the time of last change (in seconds since
+  // 1970) of what a GET or HEAD request asks for, either of which may
+  // be 0 if there's none.  They're sent along with the response.  If
+  // the If-None-Match or If-Modified-Since header of the request shows
+  // the client already has it, a 304 response is sent right away and
+  // true is returned, so the handler can skip producing the body.
+  bool notModified(uint32_t etag, uint32_t lastModified = 0);
+
+  // if the request asks for only part of something length bytes long
+  // with a Range header, set first and last to the bytes it wants and
+  // return true; otherwise all of it should be sent as usual.  Call
+  // notModified first, so an If-Range header can be checked against
+  // the validators declared there.
+  bool range(uint32_t length, uint32_t &first, uint32_t &last);
+
+  // output headers indicating "206 Partial Content", for the bytes
+  // first to last of something length bytes long
+  void httpPartialContent(const char *contentType,
+                          uint32_t first, uint32_t last, uint32_t length);
+
   // output standard headers indicating "200 Success".  You can change the
   // type of the data you're outputting or also add extra headers like
   // "Refresh: 1".  Extra headers should each be terminated with CRLF.
+  // If you know how many bytes of data will follow, pass it as
+  // contentLength so the connection can be kept open afterwards.
   void httpSuccess(const char *contentType = "text/html; charset=utf-8",
-                   const char *extraHeaders = NULL);
+                   const char *extraHeaders = NULL,
+                   long contentLength = -1);
+
+  // have the response the command handler is about to send to a GET
+  // request kept for ttl milliseconds, and sent as it is to GET
+  // requests for the same URL until then, without calling the handler.
+  // Call it before httpSuccess.  Only 200 responses that fit in
+  // WEBDUINO_RESPONSE_CACHE are kept; without it, this does nothing.
+  // As the handler isn't called, nothing it checks, checkCredentials
+  // included, is checked again; a kept response only goes to requests
+  // with the same Authorization value (or none) as the first one, so a
+  // handler behind checkCredentials may still call it, but one that
+  // checks anything else shouldn't.
+#if WEBDUINO_RESPONSE_CACHE
+  void cacheResponse(unsigned long ttl);
+#else
+  void cacheResponse(unsigned long ttl) {}
+#endif
+
+#if WEBDUINO_EVENT_STREAMS
+  // answer a GET request with the start of a text/event-stream, and
+  // keep the connection open once the handler returns, for sendEvent.
+  // Nothing else should be sent by the handler.  returns false without
+  // sending anything if the request isn't a GET or all
+  // WEBDUINO_EVENT_STREAMS streams are taken.
+  bool startEventStream();
+
+  // send an event of type name, or of the default "message" type if
+  // name is NULL, to every open event stream.  data can have several
+  // lines.  Streams whose client has gone away are closed.
+  void sendEvent(const char *name, const char *data);
+
+  // how many event streams are open, so the work of putting events
+  // together can be skipped when nobody listens
+  uint8_t eventStreams();
+#endif
+
+#if WEBDUINO_WEBSOCKETS
+  // called with each message that comes in on a WebSocket.  client
+  // tells the WebSockets apart, for sendWebSocket.  data has length
+  // bytes, with a 0 after them so a text message can be used as a
+  // string.
+  typedef void WebSocketCommand(WebServer &server, uint8_t client,
+                                char *data, size_t length, bool binary);
+
+  // from the handler of a request to upgrade to a WebSocket, complete
+  // the handshake and keep the connection open once the handler
+  // returns, passing the messages that come in on it to cmd.  Nothing
+  // else should be sent by the handler.  returns false without
+  // sending anything if the request isn't a WebSocket handshake for
+  // version 13 or all WEBDUINO_WEBSOCKETS are taken.
+  bool startWebSocket(WebSocketCommand *cmd);
+
+  // send a message to one WebSocket client, or a text message to all
+  // of them.  WebSockets whose client has gone away are closed.
+  void sendWebSocket(uint8_t client, const char *data, size_t length,
+                     bool binary = false);
+  void sendWebSocket(uint8_t client, const char *text)
+  { sendWebSocket(client, text, strlen(text)); }
+  void sendWebSocket(const char *text);
+
+  // close a WebSocket, telling the client why with a status code
+  // like 1000 for a normal close
+  void closeWebSocket(uint8_t client, uint16_t status = 1000);
+
+  // how many WebSockets are open
+  uint8_t webSockets();
+#endif
 
   // used with POST to output a redirect to another URL.  This is
   // preferable to outputting HTML from a post because you can then
@@ -316,17 +1137,207 @@ public:
   // Close the current connection and flush ethernet buffers
   void reset(); 
 private:
+  // big enough to index the output buffer
+#if WEBDUINO_OUTPUT_BUFFER_SIZE > 255
+  typedef uint16_t BufIndex;
+#else
+  typedef uint8_t BufIndex;
+#endif
+
+  // big enough to index the arena
+#if WEBDUINO_ARENA_SIZE > 255
+  typedef uint16_t ArenaIndex;
+#else
+  typedef uint8_t ArenaIndex;
+#endif
+
+  // states of the request parser
+  enum ParseState { PARSE_METHOD, PARSE_URL, PARSE_VERSION,
+                    PARSE_HEADER_NAME, PARSE_HEADER_VALUE, PARSE_BODY };
+  // headers the request parser keeps the value of
+  enum ParseHeader { HEADER_OTHER, HEADER_CONTENT_LENGTH,
+                     HEADER_AUTHORIZATION, HEADER_CONTENT_TYPE,
+                     HEADER_UPGRADE, HEADER_WEBSOCKET_KEY,
+                     // the value of these is collected in the arena
+                     HEADER_CONNECTION, HEADER_ACCEPT_ENCODING,
+                     HEADER_WEBSOCKET_VERSION, HEADER_IF_NONE_MATCH,
+                     HEADER_IF_MODIFIED_SINCE, HEADER_RANGE,
+                     HEADER_IF_RANGE };
+
+  // The parser tells methods and header names apart by their FNV-1a
+  // hash, worked out as they come in, so they needn't be stored.
+  // Header names are folded to lower case first, as their case doesn't
+  // matter.  The hashes of the names it knows are worked out by the
+  // compiler, and would clash in the switch if two were the same.
+  enum : uint32_t { HASH_START = 2166136261UL };
+  static constexpr uint32_t hashChar(uint32_t hash, uint8_t ch)
+  {
+    return (hash ^ ch) * 16777619UL;
+  }
+  static constexpr uint8_t lowerCase(uint8_t ch)
+  {
+    return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+  }
+  static constexpr uint32_t hashMethod(const char *s, uint32_t hash = HASH_START)
+  {
+    return *s ? hashMethod(s + 1, hashChar(hash, *s)) : hash;
+  }
+  static constexpr uint32_t hashName(const char *s, uint32_t hash = HASH_START)
+  {
+    return *s ? hashName(s + 1, hashChar(hash, lowerCase(*s))) : hash;
+  }
+
+  // flags for the conditions of a request
+  enum { IF_NONE_MATCH = 1, IF_NONE_MATCH_ANY = 2,
+         RANGE = 4, RANGE_SUFFIX = 8,       // bytes=first-last or bytes=-last
+         IF_RANGE = 16, IF_RANGE_DATE = 32  // ifRange is an ETag or a date
+  };
+
+  // special values for the contentLength passed to printStatus
+  enum { LENGTH_UNKNOWN = -1,  // the body ends when the connection closes
+         LENGTH_NO_BODY = -2   // the status never has a body
+  };
+
+#if WEBDUINO_CHUNKED_ENCODING
+  // whether the response being sent is split into chunks
+  enum ChunkState { CHUNKS_OFF,      // no, or not anymore
+                    CHUNKS_PENDING,  // yes, once the headers are done
+                    CHUNKS_ON        // yes, the body is being sent
+  };
+  // room kept in the output buffer for a chunk's size line; the size
+  // is always written as four hex digits so it fills the room exactly
+  enum { CHUNK_HEADER_SIZE = 6 };
+#endif
+
+  // everything we need to keep about a client while serving it
+  struct Connection
+  {
+    EthernetClient client;
+
+#if WEBDUINO_INPUT_BUFFER_SIZE
+    uint8_t input[WEBDUINO_INPUT_BUFFER_SIZE];
+    uint16_t inHead;
+    uint16_t inCount;
+#endif
+
+    long contentLength;
+    bool readingContent;
+    bool acceptGzip;
+    // how much of a word looked for in a header value was found
+    uint8_t matched;
+#if WEBDUINO_MULTIPART
+    char boundary[71];
+    uint8_t boundaryLen;
+#endif
+
+    // validators of the request and of the response to it
+#if WEBDUINO_CONDITIONAL_REQUESTS
+    uint8_t conditions;
+    uint32_t ifNoneMatch;
+    uint32_t ifModifiedSince;
+    uint32_t ifRange;
+    uint32_t rangeFirst;
+    uint32_t rangeLast;
+#endif
+    uint32_t etag;
+    uint32_t lastModified;
+
+    uint8_t buffer[WEBDUINO_OUTPUT_BUFFER_SIZE];
+    BufIndex bufFill;
+
+    uint8_t parseState;
+    uint8_t parseHeader;
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+    uint8_t capture;  // 1 + index of the captured header being read, or 0
+#endif
+    uint32_t hash;
+    ConnectionType requestType;
+    int requestLen;
+    uint8_t headerLen;
+
+    // the strings kept from the request.  The first byte is always 0,
+    // so offset 0 is an empty string, and the URL comes right after it.
+    char arena[WEBDUINO_ARENA_SIZE];
+    ArenaIndex arenaUsed;  // the end of the strings kept so far
+    ArenaIndex arenaFill;  // the end of the one being collected after them
+    bool arenaClipped;     // whether the one being collected was cut short
+    bool headerClipped;    // whether a header handlers need was cut short
+    ArenaIndex authAt;     // where the Authorization value is
+#if WEBDUINO_WEBSOCKETS
+    ArenaIndex webSocketKeyAt;  // where the Sec-WebSocket-Key value is
+    bool upgradeWebSocket;      // whether Upgrade: websocket was asked for
+    bool webSocketVersion;      // whether it's the version we speak, 13
+#endif
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+    ArenaIndex captureAt[WEBDUINO_CAPTURE_HEADERS_COUNT];
+#endif
+
+#if WEBDUINO_NONBLOCKING
+    unsigned long lastActivity;
+#endif
+
+#if WEBDUINO_KEEP_ALIVE
+    bool http11;
+    bool keepAlive;
+    bool responseFramed;
+    uint8_t requests;
+    long skip;  // what the last handler left of its body, to be skipped
+#endif
+
+#if WEBDUINO_CHUNKED_ENCODING
+    uint8_t chunkState;
+    BufIndex chunkStart;
+#endif
+
+#if WEBDUINO_METRICS
+    unsigned long started;  // micros() when the request began to arrive
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+    bool failed;            // answered with a 4xx or 5xx status
+#endif
+  };
+
+#if WEBDUINO_METRICS
+  // a sum of durations, in milliseconds and the microseconds left over
+  struct MetricsTime
+  {
+    uint32_t ms;
+    uint16_t us;
+  };
+
+  // what's counted for a route
+  struct RouteMetrics
+  {
+    const char *name;  // its verb, or NULL while the entry is free
+    bool progmem;      // whether name is in program memory
+    uint32_t requests;
+    uint32_t failures;
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+    MetricsTime time;
+    uint32_t buckets[WEBDUINO_METRICS_BUCKETS + 1];
+  };
+
+  // the parts of the work on a request that are timed separately
+  enum MetricsPhase { PHASE_PARSE, PHASE_HANDLER, PHASE_SEND, PHASE_COUNT };
+#endif
+
   EthernetServer m_server;
-  EthernetClient m_client;
+#if WEBDUINO_NONBLOCKING && !WEBDUINO_ETHERNET_ACCEPT
+  uint16_t m_port;
+#endif
   const char *m_urlPrefix;
 
+  // the connections being served and the one whose request is being
+  // worked on right now
+  Connection m_connections[WEBDUINO_MAX_CONNECTIONS];
+  Connection *m_conn;
+
+  // what a handler has pushed back.  Only handlers read from it, one at
+  // a time, so the connections share it; it's emptied after each one.
   unsigned char m_pushback[32];
   unsigned char m_pushbackDepth;
 
-  int m_contentLength;
-  char m_authCredentials[51];
-  bool m_readingContent;
-
   Command *m_failureCmd;
   Command *m_defaultCmd;
   struct CommandMap
@@ -335,24 +1346,341 @@ private:
     Command *cmd;
   } m_commands[WEBDUINO_COMMANDS_COUNT];
   unsigned char m_cmdCount;
+  const Route *m_routes;
+  uint8_t m_routeCount;
+  const Asset *m_assets;
+  uint8_t m_assetCount;
+  const char *m_filePrefix;
+  FileStore *m_fileStore;
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+  uint32_t m_captures[WEBDUINO_CAPTURE_HEADERS_COUNT];  // name hashes
+  const char *m_captureNames[WEBDUINO_CAPTURE_HEADERS_COUNT];
+#endif
+  uint8_t m_captureCount;
   UrlPathCommand *m_urlPathCmd;
+#if WEBDUINO_METRICS
+  // the last entry is for the routes that got no entry of their own
+  RouteMetrics m_routeMetrics[WEBDUINO_METRICS_ROUTES];
+  RouteMetrics *m_metricsRoute;  // the route of the request being handled
+  MetricsTime m_phaseTime[PHASE_COUNT];
+  uint32_t m_timeouts;
+#endif
+#if WEBDUINO_RESPONSE_CACHE
+  // a response kept by cacheResponse.  From offset on, m_cachePool
+  // has the URL it answers, then the headers that followed the status
+  // line and the body.
+  struct CachedResponse
+  {
+    uint16_t offset;
+    uint8_t keyLen;     // the URL, a NUL and the Authorization value
+    uint16_t headLen;   // the headers, with the empty line after them
+    uint16_t length;    // the headers and the body
+    unsigned long expires;
+    uint32_t etag;
+    uint32_t lastModified;
+#if WEBDUINO_METRICS
+    RouteMetrics *route;
+#endif
+  };
+  // the responses kept, oldest first, one after the other in the pool.
+  // The one being kept is collected in the entry after them.
+  CachedResponse m_cached[WEBDUINO_RESPONSE_CACHE_ENTRIES];
+  uint8_t m_cachedCount;
+  uint8_t m_cachePool[WEBDUINO_RESPONSE_CACHE];
+  const char *m_cacheURL;    // a copy of the URL being handled, or NULL
+  unsigned long m_cacheTtl;  // what the handler asked for, or 0
+  bool m_caching;            // whether the response is being kept
+#endif
 
-  uint8_t m_buffer[WEBDUINO_OUTPUT_BUFFER_SIZE];
-  uint8_t m_bufFill;
+#if WEBDUINO_EVENT_STREAMS
+  // a client that gets events, and when it last got anything
+  struct EventStream
+  {
+    EthernetClient client;
+    unsigned long lastSent;
+  } m_streams[WEBDUINO_EVENT_STREAMS];
+#endif
 
-  void getRequest(WebServer::ConnectionType &type, char *request, int *length);
-  bool dispatchCommand(ConnectionType requestType, char *verb,
-                       bool tail_complete);
-  void processHeaders();
-  void outputCheckboxOrRadio(const char *element, const char *name,
-                             const char *val, const char *label,
-                             bool selected);
+#if WEBDUINO_WEBSOCKETS
+  // states of the WebSocket frame parser
+  enum FrameState { FRAME_OPCODE, FRAME_LENGTH, FRAME_EXTENDED_LENGTH,
+                    FRAME_MASK, FRAME_PAYLOAD };
+  enum { OPCODE_CONTINUATION = 0, OPCODE_TEXT = 1, OPCODE_BINARY = 2,
+         OPCODE_CLOSE = 8, OPCODE_PING = 9, OPCODE_PONG = 10 };
 
-  static void defaultFailCmd(WebServer &server, ConnectionType type,
-                             char *url_tail, bool tail_complete);
-  void noRobots(ConnectionType type);
-  void favicon(ConnectionType type);
-};
+  // a WebSocket client, and the frame and message coming in from it
+  struct WebSocket
+  {
+    EthernetClient client;
+    WebSocketCommand *cmd;
+    unsigned long lastSent;
+    uint8_t frameState;
+    uint8_t frameOpcode;    // with the FIN bit
+    uint8_t messageOpcode;  // text or binary, or 0 between messages
+    uint8_t count;          // length or mask bytes still to come
+    uint8_t mask[4];
+    uint32_t left;          // payload bytes still to come
+    uint16_t frameFill;     // payload bytes of the frame so far
+    uint16_t fill;          // bytes of the message before the frame
+    char message[WEBDUINO_WEBSOCKET_MESSAGE_SIZE +
+                 WEBDUINO_WEBSOCKET_CONTROL_SIZE + 1];
+  } m_webSockets[WEBDUINO_WEBSOCKETS];
+#endif
+
+  int readInput();
+  uint8_t capturing()
+  {
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+    return m_conn->capture;
+#else
+    return 0;
+#endif
+  }
+  uint16_t inputCount()
+  {
+#if WEBDUINO_INPUT_BUFFER_SIZE
+    return m_conn->inCount;
+#else
+    return 0;
+#endif
+  }
+  size_t clientWrite(const uint8_t *buffer, size_t size);
+  BufIndex bufLimit();
+  bool dispatchCommand(ConnectionType requestType, char *verb,
+                       bool tail_complete);
+
+  // look up verb in a sorted table of routes or assets in program
+  // memory
+  template<class T>
+  static const T *findEntry(const T *table, uint8_t count,
+                            const char *verb, uint16_t verb_len)
+  {
+    if (verb_len >= WEBDUINO_ROUTE_VERB_LENGTH)
+      return NULL;
+
+    unsigned lo = 0;
+    unsigned hi = count;
+    while (lo < hi)
+    {
+      unsigned mid = (lo + hi) / 2;
+      const T *entry = table + mid;
+      // verb isn't NUL terminated, so a longer entry verb has to be
+      // caught separately
+      int cmp = strncmp_P(verb, entry->verb, verb_len);
+      if (cmp == 0)
+        cmp = -(int)pgm_read_byte(entry->verb + verb_len);
+      if (cmp == 0)
+        return entry;
+      if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    return NULL;
+  }
+  void handleRequest(ConnectionType requestType, char *buff,
+                     bool tail_complete);
+  static uint8_t matchWord(const char *word, uint8_t matched, int ch);
+  static void addJsonChar(char *buffer, uint8_t size, uint8_t &length,
+                          char ch);
+  static void addJsonUTF8(char *buffer, uint8_t size, uint8_t &length,
+                          uint32_t code);
+  static char decodeURLchar(char *&s);
+  static int8_t hexValue(char ch);
+  static size_t decodeURL(char *&s, char stop);
+  void resetConditions();
+#if WEBDUINO_CONDITIONAL_REQUESTS
+  void parseIfNoneMatch(const char *value);
+  static uint32_t parseETag(const char *value);
+  void parseRange(const char *value);
+  void parseIfRange(const char *value);
+#endif
+  void parseAcceptEncoding(const char *value);
+  void printContentRange(uint32_t first, uint32_t last, uint32_t length);
+  void printStaticHeaders(const unsigned char *contentType, uint32_t length,
+                          uint32_t &first, uint32_t &last);
+  bool dispatchFile(ConnectionType type, char *path, uint16_t path_len);
+  static const unsigned char *mimeType(const char *path);
+  static uint32_t parseDate(const char *value);
+  static uint32_t daysFromCivil(unsigned year, unsigned month, unsigned day);
+  void printValidators();
+#if WEBDUINO_NONBLOCKING
+  void acceptConnection();
+#if !WEBDUINO_ETHERNET_ACCEPT
+  bool serving(EthernetClient &client);
+#endif
+  bool parseRequest();
+#endif
+  void startRequest();
+  void parseRequestChar(char ch);
+  void parseHeaderName();
+  void clearArena();
+  void arenaAdd(char ch);
+  char *arenaString();
+  ArenaIndex arenaKeep();
+  void arenaDrop();
+  char *requestURL(bool *complete);
+  void printStatus(const unsigned char *status, long contentLength);
+  void httpTooLong(bool url);
+  void badContentLength();
+  void renderSlots(const unsigned char *tpl, const TemplateSlot *slots,
+                   TemplateCommand *cmd);
+#if WEBDUINO_RESPONSE_CACHE
+  bool sendCached(const char *url);
+  const char *cacheAuth();
+  void startCaching(const unsigned char *status);
+  void cacheBytes(const uint8_t *data, size_t size, bool progmem);
+  void endCaching();
+  void dropCached(uint8_t i);
+  uint16_t cachedEnd();
+#else
+  void cacheBytes(const uint8_t *data, size_t size, bool progmem) {}
+#endif
+  void endHeaders();
+#if WEBDUINO_EVENT_STREAMS
+  void serveEventStreams();
+  size_t addToEvent(uint8_t *event, size_t fill,
+                    const char *data, size_t size);
+  void streamWrite(EventStream &stream, const uint8_t *data, size_t size);
+#endif
+#if WEBDUINO_WEBSOCKETS
+  void serveWebSockets();
+  void readFrames(uint8_t client);
+  void endFrame(uint8_t client);
+  void sendFrame(WebSocket &ws, uint8_t opcode,
+                 const uint8_t *payload, size_t length);
+  static void sha1(const uint8_t *data, size_t length, uint8_t *digest);
+  static void sha1Block(uint32_t *state, const uint8_t *block);
+#endif
+#if WEBDUINO_CHUNKED_ENCODING
+  void sendChunk(bool last);
+#endif
+  void format(const char *fmt, bool progmem, va_list args);
+  void printPadding(char ch, uint8_t count);
+  static char *formatDecimal(char *end, unsigned long number);
+  static char *formatHex(char *end, unsigned long number,
+                         const char *digits = "0123456789abcdef");
+  static char *formatFixed(char *end, unsigned long whole,
+                           unsigned long fraction, uint8_t decimals);
+  void outputCheckboxOrRadio(const char *element, const char *name,
+                             const char *val, const char *label,
+                             bool selected);
+
+  static void defaultFailCmd(WebServer &server, ConnectionType type,
+                             char *url_tail, bool tail_complete);
+  void noRobots(ConnectionType type);
+  void favicon(ConnectionType type);
+
+  // count the request being handled for the route called name, which
+  // is looked up by its address, so it has to be the same every time
+#if WEBDUINO_METRICS
+  void metricsRoute(const char *name, bool progmem);
+  void countRequest();
+  static void addTime(MetricsTime &time, unsigned long us);
+  void printTime(const MetricsTime &time);
+  void printRouteLabel(const unsigned char *metric, const RouteMetrics &route);
+  void printRouteCounter(const unsigned char *metric,
+                         uint32_t RouteMetrics::*counter);
+  void metrics(ConnectionType type);
+#else
+  void metricsRoute(const char *name, bool progmem) {}
+#endif
+  // for a name defined with the P macro
+  void metricsRoute(const unsigned char *name)
+    { metricsRoute((const char *)name, true); }
+};
+
+#ifdef __SD_H__
+// the files of an SD card, for serveFiles.  It's only there when SD.h
+// is included before WebServer.h, and SD.begin has to be called first.
+class SDFileStore : public WebServer::FileStore
+{
+public:
+  virtual bool open(const char *path);
+  virtual void close();
+  virtual uint32_t size();
+  virtual bool seek(uint32_t pos);
+  virtual int read(uint8_t *buffer, uint16_t len);
+
+private:
+  File m_file;
+};
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <stdio.h>
+#include <sys/stat.h>
+
+// the files below a directory of the computer the server is built for,
+// to try file serving, or a whole application, on a PC
+class PosixFileStore : public WebServer::FileStore
+{
+public:
+  PosixFileStore(const char *root);
+
+  virtual bool open(const char *path);
+  virtual void close();
+  virtual uint32_t size();
+  virtual uint32_t lastModified();
+  virtual bool seek(uint32_t pos);
+  virtual int read(uint8_t *buffer, uint16_t len);
+
+private:
+  const char *m_root;
+  FILE *m_file;
+  struct stat m_stat;
+};
+#endif
+
+// Writes a JSON document straight into the server's output buffer as
+// it's built, so its size doesn't matter and it takes no RAM besides
+// the writer itself.  Every call returns the writer, to chain them:
+//
+//   JsonWriter json(server);
+//   json.beginObject().key("uptime").value(millis())
+//       .key("temp").fixed(2315, 2).endObject();
+//
+// Commas are put in by the writer; it keeps track of up to 32 levels
+// of nested objects and arrays.
+class JsonWriter
+{
+public:
+  JsonWriter(WebServer &server);
+
+  JsonWriter &beginObject();
+  JsonWriter &endObject();
+  JsonWriter &beginArray();
+  JsonWriter &endArray();
+
+  // the name of the next member of an object, from RAM or PROGMEM
+  JsonWriter &key(const char *name);
+  JsonWriter &keyP(const unsigned char *name);
+
+  // strings are escaped as needed
+  JsonWriter &value(const char *str);
+  JsonWriter &valueP(const unsigned char *str);
+  JsonWriter &value(int number);
+  JsonWriter &value(unsigned int number);
+  JsonWriter &value(long number);
+  JsonWriter &value(unsigned long number);
+  JsonWriter &value(bool b);
+  // NaN and infinity have no JSON form, and Print can't write numbers
+  // beyond +-4294967040 (it gives "ovf"), so these come out as null
+  JsonWriter &value(double number, uint8_t digits = 2);
+  // written with WebServer::printFixed
+  JsonWriter &fixed(long number, uint8_t decimals);
+  JsonWriter &null();
+
+private:
+  WebServer &m_server;
+  uint32_t m_members;  // one bit for each level, set once it has members
+  bool m_key;          // a key was written and waits for its value
+
+  void separate();
+  JsonWriter &begin(char ch);
+  JsonWriter &end(char ch);
+  void writeEscaped(char ch);
+};
 
 /* define this macro if you want to include the header in a sketch source
    file but not define any of the implementation. This is useful if
@@ -365,16 +1693,45 @@ private:
 
 WebServer::WebServer(const char *urlPrefix, uint16_t port) :
   m_server(port),
-  m_client(),
+#if WEBDUINO_NONBLOCKING && !WEBDUINO_ETHERNET_ACCEPT
+  m_port(port),
+#endif
   m_urlPrefix(urlPrefix),
-  m_pushbackDepth(0),
-  m_contentLength(0),
+  m_conn(m_connections),
   m_failureCmd(&defaultFailCmd),
   m_defaultCmd(&defaultFailCmd),
   m_cmdCount(0),
-  m_urlPathCmd(NULL),
-  m_bufFill(0)
+  m_routes(NULL),
+  m_routeCount(0),
+  m_assets(NULL),
+  m_assetCount(0),
+  m_filePrefix(NULL),
+  m_fileStore(NULL),
+  m_captureCount(0),
+  m_urlPathCmd(NULL)
 {
+  m_pushbackDepth = 0;
+  for (uint8_t i = 0; i < SIZE(m_connections); ++i)
+  {
+#if WEBDUINO_INPUT_BUFFER_SIZE
+    m_connections[i].inHead = 0;
+    m_connections[i].inCount = 0;
+#endif
+    m_connections[i].contentLength = 0;
+    m_connections[i].bufFill = 0;
+  }
+#if WEBDUINO_METRICS
+  memset(m_routeMetrics, 0, sizeof(m_routeMetrics));
+  memset(m_phaseTime, 0, sizeof(m_phaseTime));
+  m_metricsRoute = &m_routeMetrics[SIZE(m_routeMetrics) - 1];
+  m_timeouts = 0;
+#endif
+#if WEBDUINO_RESPONSE_CACHE
+  m_cachedCount = 0;
+  m_cacheURL = NULL;
+  m_cacheTtl = 0;
+  m_caching = false;
+#endif
 }
 
 P(webServerHeader) = "Server: Webduino/" WEBDUINO_VERSION_STRING CRLF;
@@ -403,627 +1760,3170 @@ void WebServer::addCommand(const char *verb, Command *cmd)
   }
 }
 
-void WebServer::setUrlPathCommand(UrlPathCommand *cmd)
+void WebServer::setRoutes(const Route *routes, uint8_t count)
 {
-  m_urlPathCmd = cmd;
+  m_routes = routes;
+  m_routeCount = count;
 }
 
-size_t WebServer::write(uint8_t ch)
+void WebServer::setAssets(const Asset *assets, uint8_t count)
 {
-  m_buffer[m_bufFill++] = ch;
-
-  if(m_bufFill == sizeof(m_buffer))
-  {
-    m_client.write(m_buffer, sizeof(m_buffer));
-    m_bufFill = 0;
-  }
-
-  return sizeof(ch);
+  m_assets = assets;
+  m_assetCount = count;
 }
 
-size_t WebServer::write(const uint8_t *buffer, size_t size)
+void WebServer::serveFiles(const char *prefix, FileStore *store)
 {
-  flushBuf(); //Flush any buffered output
-  return m_client.write(buffer, size);
+  m_filePrefix = prefix;
+  m_fileStore = store;
 }
 
-void WebServer::flushBuf()
+void WebServer::captureHeader(const char *name)
 {
-  if(m_bufFill > 0)
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+  if (m_captureCount < SIZE(m_captures) &&
+      strlen(name) <= WEBDUINO_HEADER_NAME_LENGTH)
   {
-    m_client.write(m_buffer, m_bufFill);
-    m_bufFill = 0;
+    m_captures[m_captureCount] = hashName(name);
+    m_captureNames[m_captureCount++] = name;
   }
+#endif
 }
 
-void WebServer::writeP(const unsigned char *data, size_t length)
+const char *WebServer::header(const char *name)
 {
-  // copy data out of program memory into local storage
-
-  while (length--)
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+  uint32_t hash = hashName(name);
+  for (uint8_t i = 0; i < m_captureCount; ++i)
   {
-    write(pgm_read_byte(data++));
+    if (m_captures[i] == hash && strcasecmp(name, m_captureNames[i]) == 0)
+      return m_conn->arena + m_conn->captureAt[i];
   }
+#endif
+  return NULL;
 }
 
-void WebServer::printP(const unsigned char *str)
+// Let go of everything in the arena, leaving only the empty string at
+// its start and an empty URL after it.
+void WebServer::clearArena()
 {
-  // copy data out of program memory into local storage
+  m_conn->arena[0] = 0;
+  m_conn->arena[1] = 0;
+  m_conn->arenaUsed = 1;
+  m_conn->arenaFill = 1;
+  m_conn->arenaClipped = false;
+  m_conn->headerClipped = false;
+  m_conn->authAt = 0;
+#if WEBDUINO_WEBSOCKETS
+  m_conn->webSocketKeyAt = 0;
+#endif
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+  for (uint8_t i = 0; i < m_captureCount; ++i)
+    m_conn->captureAt[i] = 0;
+#endif
+}
 
-  while (uint8_t value = pgm_read_byte(str++))
+// Add a character to the string being collected at the top of the
+// arena, if there's room for it and the 0 after it, or note that the
+// string was cut short.
+void WebServer::arenaAdd(char ch)
+{
+  if (m_conn->arenaFill < WEBDUINO_ARENA_SIZE - 1)
   {
-    write(value);
+    m_conn->arena[m_conn->arenaFill++] = ch;
+    m_conn->arena[m_conn->arenaFill] = 0;
   }
+  else
+    m_conn->arenaClipped = true;
 }
 
-void WebServer::printCRLF()
+// the string being collected
+char *WebServer::arenaString()
 {
-  print(CRLF);
+  return m_conn->arena + m_conn->arenaUsed;
 }
 
-void WebServer::printf(char *fmt, ... )
+// Keep the string being collected, and start the next one after it.
+// returns where it is in the arena.
+WebServer::ArenaIndex WebServer::arenaKeep()
 {
-  char tmp[128]; // resulting string limited to 128 chars
-  va_list args;
-  va_start (args, fmt );
-  vsnprintf(tmp, 128, fmt, args);
-  va_end (args);
-  print(tmp);
+  ArenaIndex at = m_conn->arenaUsed;
+  // once the arena is full, the last 0 is shared by the empty strings
+  // that still come
+  if (m_conn->arenaFill < WEBDUINO_ARENA_SIZE - 1)
+    ++m_conn->arenaFill;
+  m_conn->arenaUsed = m_conn->arenaFill;
+  m_conn->arena[m_conn->arenaFill] = 0;
+  m_conn->arenaClipped = false;
+  return at;
 }
 
-#ifdef F
-void WebServer::printf(const __FlashStringHelper *format, ... )
+// Throw away the string being collected.
+void WebServer::arenaDrop()
 {
-  char buf[128]; // resulting string limited to 128 chars
-  va_list ap;
-  va_start(ap, format);
-#ifdef __AVR__
-  vsnprintf_P(buf, sizeof(buf), (const char *)format, ap); // progmem for AVR
-#else
-  vsnprintf(buf, sizeof(buf), (const char *)format, ap); // for the rest of the world
-#endif  
-  va_end(ap);
-  print(buf);
+  m_conn->arenaFill = m_conn->arenaUsed;
+  m_conn->arena[m_conn->arenaFill] = 0;
+  m_conn->arenaClipped = false;
+}
+
+// the URL of the request, and whether none of it was cut short
+char *WebServer::requestURL(bool *complete)
+{
+  char *url = m_conn->arena + 1;
+  *complete = (int)strlen(url) == m_conn->requestLen;
+  return url;
 }
+
+void WebServer::setUrlPathCommand(UrlPathCommand *cmd)
+{
+  m_urlPathCmd = cmd;
+}
+
+// how far the output buffer may be filled before it has to be sent
+WebServer::BufIndex WebServer::bufLimit()
+{
+#if WEBDUINO_CHUNKED_ENCODING
+  // leave room for the CRLF that ends the chunk
+  if (m_conn->chunkState == CHUNKS_ON)
+    return sizeof(m_conn->buffer) - 2;
 #endif
+  return sizeof(m_conn->buffer);
+}
 
-bool WebServer::dispatchCommand(ConnectionType requestType, char *verb,
-        bool tail_complete)
+size_t WebServer::write(uint8_t ch)
 {
-  // if there is no URL, i.e. we have a prefix and it's requested without a
-  // trailing slash or if the URL is just the slash
-  if ((verb[0] == 0) || ((verb[0] == '/') && (verb[1] == 0)))
+  cacheBytes(&ch, 1, false);
+  m_conn->buffer[m_conn->bufFill++] = ch;
+
+  if(m_conn->bufFill == bufLimit())
   {
-    m_defaultCmd(*this, requestType, (char*)"", tail_complete);
-    return true;
+    flushBuf();
   }
-  // if the URL is just a slash followed by a question mark
-  // we're looking at the default command with GET parameters passed
-  if ((verb[0] == '/') && (verb[1] == '?'))
+
+  return sizeof(ch);
+}
+
+size_t WebServer::write(const uint8_t *buffer, size_t size)
+{
+  cacheBytes(buffer, size, false);
+
+  BufIndex limit = bufLimit();
+  bool direct = size >= limit;
+#if WEBDUINO_CHUNKED_ENCODING
+  // the body has to go through the buffer to be split into chunks
+  if (m_conn->chunkState == CHUNKS_ON)
+    direct = false;
+#endif
+
+  // data that wouldn't fit into the buffer anyway goes out on its own
+  if (direct)
   {
-    verb+=2; // skip over the "/?" part of the url
-    m_defaultCmd(*this, requestType, verb, tail_complete);
-    return true;
+    flushBuf(); //Flush any buffered output
+    return clientWrite(buffer, size);
   }
-  // We now know that the URL contains at least one character.  And,
-  // if the first character is a slash,  there's more after it.
-  if (verb[0] == '/')
+
+  // anything else joins what's already waiting
+  for (size_t left = size; left > 0; )
   {
-    uint8_t i;
-    char *qm_loc;
-    uint16_t verb_len;
-    uint8_t qm_offset;
-    // Skip over the leading "/",  because it makes the code more
-    // efficient and easier to understand.
-    verb++;
-    // Look for a "?" separating the filename part of the URL from the
-    // parameters.  If it's not there, compare to the whole URL.
-    qm_loc = strchr(verb, '?');
-    verb_len = (qm_loc == NULL) ? strlen(verb) : (qm_loc - verb);
-    qm_offset = (qm_loc == NULL) ? 0 : 1;
-    for (i = 0; i < m_cmdCount; ++i)
-    {
-      if ((verb_len == strlen(m_commands[i].verb))
-          && (strncmp(verb, m_commands[i].verb, verb_len) == 0))
-      {
-        // Skip over the "verb" part of the URL (and the question
-        // mark, if present) when passing it to the "action" routine
-        m_commands[i].cmd(*this, requestType,
-        verb + verb_len + qm_offset,
-        tail_complete);
-        return true;
-      }
-    }
-    // Check if UrlPathCommand is assigned.
-    if (m_urlPathCmd != NULL)
-    {
-      // Initialize with null bytes, so number of parts can be determined.
-      char *url_path[WEBDUINO_URL_PATH_COMMAND_LENGTH] = {0};
-      uint8_t part = 0;
+    size_t count = limit - m_conn->bufFill;
+    if (count > left)
+      count = left;
 
-      // URL path should be terminated with null byte.
-      *(verb + verb_len) = 0;
+    memcpy(m_conn->buffer + m_conn->bufFill, buffer, count);
+    m_conn->bufFill += count;
+    buffer += count;
+    left -= count;
 
-      // First URL path part is at the start of verb.
-      url_path[part++] = verb;
-      // Replace all slashes ('/') with a null byte so every part of the URL
-      // path is a seperate string. Add every char following a '/' as a new
-      // part of the URL, even if that char is a '/' (which will be replaced
-      // with a null byte).
-      for (char * p = verb; p < verb + verb_len; p++)
-      {
-        if (*p == '/')
-        {
-          *p = 0;
-          url_path[part++] = p + 1;
-          // Don't try to assign out of array bounds.
-          if (part == WEBDUINO_URL_PATH_COMMAND_LENGTH) break;
-        }
-      }
-      m_urlPathCmd(*this, requestType, url_path,
-                   verb + verb_len + qm_offset, tail_complete);
-      return true;
-    }
+    if (m_conn->bufFill == limit)
+      flushBuf();
   }
-  return false;
+  return size;
 }
 
-// processConnection with a default buffer
-void WebServer::processConnection()
+void WebServer::flush()
 {
-  char request[WEBDUINO_DEFAULT_REQUEST_LENGTH];
-  int  request_len = WEBDUINO_DEFAULT_REQUEST_LENGTH;
-  processConnection(request, &request_len);
+  flushBuf();
 }
 
-void WebServer::processConnection(char *buff, int *bufflen)
+void WebServer::flushBuf()
 {
-  int urlPrefixLen = strlen(m_urlPrefix);
-
-  m_client = m_server.available();
-
-  if (m_client) {
-    m_readingContent = false;
-    buff[0] = 0;
-    ConnectionType requestType = INVALID;
-#if WEBDUINO_SERIAL_DEBUGGING > 1
-    Serial.println("*** checking request ***");
-#endif
-    getRequest(requestType, buff, bufflen);
-#if WEBDUINO_SERIAL_DEBUGGING > 1
-    Serial.print("*** requestType = ");
-    Serial.print((int)requestType);
-    Serial.print(", request = \"");
-    Serial.print(buff);
-    Serial.println("\" ***");
+#if WEBDUINO_CHUNKED_ENCODING
+  if (m_conn->chunkState == CHUNKS_ON)
+  {
+    sendChunk(false);
+    return;
+  }
 #endif
+  if(m_conn->bufFill > 0)
+  {
+    clientWrite(m_conn->buffer, m_conn->bufFill);
+    m_conn->bufFill = 0;
+  }
+}
 
-    // don't even look further at invalid requests.
-    // this is done to prevent Webduino from hanging
-    // - when there are illegal requests,
-    // - when someone contacts it through telnet rather than proper HTTP,
-    // - etc.
-    if (requestType != INVALID)
-    {
-      processHeaders();
-#if WEBDUINO_SERIAL_DEBUGGING > 1
-      Serial.println("*** headers complete ***");
+// Send data to the client, counting it and the time it takes.
+size_t WebServer::clientWrite(const uint8_t *buffer, size_t size)
+{
+#if WEBDUINO_METRICS
+  unsigned long start = micros();
+  size_t sent = m_conn->client.write(buffer, size);
+  addTime(m_phaseTime[PHASE_SEND], micros() - start);
+  m_conn->bytesOut += sent;
+  return sent;
+#else
+  return m_conn->client.write(buffer, size);
 #endif
+}
 
-      if (strcmp(buff, "/robots.txt") == 0)
-      {
-        noRobots(requestType);
-      }
-      else if (strcmp(buff, "/favicon.ico") == 0)
-      {
-        favicon(requestType);
-      }
-    }
-    // Only try to dispatch command if request type and prefix are correct.
-    // Fix by quarencia.
-    if (requestType == INVALID ||
-        strncmp(buff, m_urlPrefix, urlPrefixLen) != 0)
+#if WEBDUINO_CHUNKED_ENCODING
+// Send the body collected in the output buffer as one chunk, together
+// with any headers still waiting in front of it.  The last chunk is
+// followed by the zero-length one that ends the body.
+void WebServer::sendChunk(bool last)
+{
+  uint8_t *sizeLine = m_conn->buffer + m_conn->chunkStart;
+  int len = m_conn->bufFill - m_conn->chunkStart - CHUNK_HEADER_SIZE;
+  int fill = m_conn->chunkStart;
+
+  if (len > 0)
+  {
+    for (int8_t i = 3; i >= 0; --i)
     {
-      m_failureCmd(*this, requestType, buff, (*bufflen) >= 0);
+      sizeLine[i] = "0123456789abcdef"[len & 15];
+      len >>= 4;
     }
-    else if (!dispatchCommand(requestType, buff + urlPrefixLen,
-             (*bufflen) >= 0))
+    sizeLine[4] = '\r';
+    sizeLine[5] = '\n';
+    m_conn->buffer[m_conn->bufFill++] = '\r';
+    m_conn->buffer[m_conn->bufFill++] = '\n';
+    fill = m_conn->bufFill;
+  }
+
+  if (last)
+  {
+    if (fill + 5 > (int)sizeof(m_conn->buffer))
     {
-      m_failureCmd(*this, requestType, buff, (*bufflen) >= 0);
+      clientWrite(m_conn->buffer, fill);
+      fill = 0;
     }
+    memcpy(m_conn->buffer + fill, "0" CRLF CRLF, 5);
+    fill += 5;
+  }
 
-    flushBuf();
-
-#if WEBDUINO_SERIAL_DEBUGGING > 1
-    Serial.println("*** stopping connection ***");
+  if (fill > 0)
+    clientWrite(m_conn->buffer, fill);
+  m_conn->chunkStart = 0;
+  m_conn->bufFill = CHUNK_HEADER_SIZE;
+}
 #endif
-    reset();
+
+void WebServer::writeP(const unsigned char *data, size_t length)
+{
+  // copy data out of program memory straight into the output buffer,
+  // as much as fits at a time, and send it whenever the buffer fills
+
+  while (length > 0)
+  {
+    BufIndex limit = bufLimit();
+    size_t count = limit - m_conn->bufFill;
+    if (count > length)
+      count = length;
+
+    memcpy_P(m_conn->buffer + m_conn->bufFill, data, count);
+    cacheBytes(data, count, true);
+    m_conn->bufFill += count;
+    data += count;
+    length -= count;
+
+    if (m_conn->bufFill == limit)
+      flushBuf();
   }
 }
 
-bool WebServer::checkCredentials(const char authCredentials[45])
+void WebServer::printP(const unsigned char *str)
 {
-  char basic[7] = "Basic ";
-  if((0 == strncmp(m_authCredentials,basic,6)) &&
-     (0 == strcmp(authCredentials, m_authCredentials + 6))) return true;
-  return false;
+  // like writeP, but the end of the string is only found as we go
+
+  for (;;)
+  {
+    BufIndex limit = bufLimit();
+    size_t room = limit - m_conn->bufFill;
+    size_t count = strnlen_P((const char *)str, room);
+
+    memcpy_P(m_conn->buffer + m_conn->bufFill, str, count);
+    cacheBytes(str, count, true);
+    m_conn->bufFill += count;
+    str += count;
+
+    if (m_conn->bufFill == limit)
+      flushBuf();
+    if (count < room)
+      break;
+  }
 }
 
-void WebServer::httpFail()
+void WebServer::printCRLF()
 {
-  P(failMsg1) = "HTTP/1.0 400 Bad Request" CRLF;
-  printP(failMsg1);
+  print(CRLF);
+}
 
-#ifndef WEBDUINO_SUPRESS_SERVER_HEADER
-  printP(webServerHeader);
-#endif
+void WebServer::printf(const char *fmt, ... )
+{
+  va_list args;
+  va_start(args, fmt);
+  format(fmt, false, args);
+  va_end(args);
+}
 
-  P(failMsg2) = 
-    "Content-Type: text/html" CRLF
-    CRLF
-    WEBDUINO_FAIL_MESSAGE;
+#ifdef F
+void WebServer::printf(const __FlashStringHelper *format, ... )
+{
+  va_list ap;
+  va_start(ap, format);
+  this->format((const char *)format, true, ap);
+  va_end(ap);
+}
+#endif
 
-  printP(failMsg2);
+// The formatter behind both printf.  Text between the conversions is
+// written in runs, and each conversion is put together backwards in a
+// small buffer on the stack, in front of its padding.
+void WebServer::format(const char *fmt, bool progmem, va_list args)
+{
+  while (1)
+  {
+    const char *run = fmt;
+    char ch;
+    while ((ch = progmem ? pgm_read_byte(fmt) : *fmt) != 0 && ch != '%')
+      ++fmt;
+    if (progmem)
+      writeP((const unsigned char *)run, fmt - run);
+    else
+      write((const uint8_t *)run, fmt - run);
+    if (ch == 0)
+      return;
+
+    bool left = false, zero = false, isLong = false;
+    uint8_t width = 0;
+    int16_t precision = -1;
+    while ((ch = progmem ? pgm_read_byte(++fmt) : *++fmt) == '-' || ch == '0')
+    {
+      if (ch == '-')
+        left = true;
+      else
+        zero = true;
+    }
+    // both stop at the most they can hold rather than wrap around
+    for (; ch >= '0' && ch <= '9'; ch = progmem ? pgm_read_byte(++fmt) : *++fmt)
+    {
+      uint16_t w = width * 10 + ch - '0';
+      width = (w > 255) ? 255 : w;
+    }
+    if (ch == '.')
+    {
+      precision = 0;
+      while ((ch = progmem ? pgm_read_byte(++fmt) : *++fmt) >= '0' && ch <= '9')
+      {
+        long p = precision * 10L + ch - '0';
+        precision = (p > 32767) ? 32767 : p;
+      }
+    }
+    if (ch == 'l')
+    {
+      isLong = true;
+      ch = progmem ? pgm_read_byte(++fmt) : *++fmt;
+    }
+    if (ch == 0)
+      return;
+    ++fmt;
+
+    char buf[22];
+    char *end = buf + sizeof(buf);
+    const char *text = end;
+    bool negative = false, textP = false;
+    size_t len;
+    switch (ch)
+    {
+    case 'd':
+    case 'i':
+    {
+      long number = isLong ? va_arg(args, long) : va_arg(args, int);
+      unsigned long magnitude = number;
+      if (number < 0)
+      {
+        negative = true;
+        magnitude = -magnitude;
+      }
+      text = formatDecimal(end, magnitude);
+      break;
+    }
+    case 'u':
+    case 'x':
+    case 'X':
+    {
+      unsigned long number = isLong ? va_arg(args, unsigned long)
+                                    : va_arg(args, unsigned int);
+      if (ch == 'u')
+        text = formatDecimal(end, number);
+      else
+        text = formatHex(end, number, (ch == 'x') ? "0123456789abcdef"
+                                                  : "0123456789ABCDEF");
+      break;
+    }
+    case 'f':
+    {
+      double number = va_arg(args, double);
+      if (number < 0)
+      {
+        negative = true;
+        number = -number;
+      }
+      if (precision < 0)
+        precision = 6;
+      if (precision > 9)
+        precision = 9;
+      unsigned long scale = 1;
+      for (int8_t i = 0; i < precision; ++i)
+        scale *= 10;
+      unsigned long whole = number;
+      unsigned long fraction = (number - whole) * scale + 0.5;
+      if (fraction >= scale)
+      {
+        ++whole;
+        fraction -= scale;
+      }
+      text = formatFixed(end, whole, fraction, precision);
+      break;
+    }
+    case 'c':
+      buf[0] = va_arg(args, int);
+      text = buf;
+      end = buf + 1;
+      break;
+    case 's':
+    case 'S':
+      text = va_arg(args, const char *);
+      textP = (ch == 'S');
+      // like most C libraries do
+      if (text == NULL)
+      {
+        text = PSTR("(null)");
+        textP = true;
+      }
+      break;
+    default:
+      // %% and anything unknown come out as they are
+      buf[0] = ch;
+      text = buf;
+      end = buf + 1;
+      break;
+    }
+
+    if ((ch == 's' || ch == 'S') && precision < 0)
+      len = textP ? strlen_P(text) : strlen(text);
+    else if (ch == 's' || ch == 'S')
+    {
+      // the precision is the most of the string to write
+      len = textP ? strnlen_P(text, precision) : strnlen(text, precision);
+    }
+    else
+      len = end - text;
+
+    uint8_t padding = 0;
+    if (width > len + negative)
+      padding = width - len - negative;
+    if (!left && !zero)
+      printPadding(' ', padding);
+    if (negative)
+      write('-');
+    if (!left && zero)
+      printPadding('0', padding);
+    if (textP)
+      writeP((const unsigned char *)text, len);
+    else
+      write((const uint8_t *)text, len);
+    if (left)
+      printPadding(' ', padding);
+  }
 }
 
-void WebServer::defaultFailCmd(WebServer &server,
-                               WebServer::ConnectionType type,
-                               char *url_tail,
-                               bool tail_complete)
+void WebServer::printPadding(char ch, uint8_t count)
 {
-  server.httpFail();
+  while (count-- > 0)
+    write(ch);
 }
 
-void WebServer::noRobots(ConnectionType type)
+// Put the digits of number in front of end, returning where they start.
+char *WebServer::formatDecimal(char *end, unsigned long number)
 {
-  httpSuccess("text/plain");
-  if (type != HEAD)
+  do
   {
-    P(allowNoneMsg) = "User-agent: *" CRLF "Disallow: /" CRLF;
-    printP(allowNoneMsg);
-  }
+    *--end = '0' + number % 10;
+    number /= 10;
+  } while (number != 0);
+  return end;
 }
 
-void WebServer::favicon(ConnectionType type)
+char *WebServer::formatHex(char *end, unsigned long number,
+                           const char *digits)
 {
-  httpSuccess("image/x-icon","Cache-Control: max-age=31536000\r\n");
-  if (type != HEAD)
+  do
   {
-    P(faviconIco) = WEBDUINO_FAVICON_DATA;
-    writeP(faviconIco, sizeof(faviconIco));
-  }
+    *--end = digits[number & 15];
+    number >>= 4;
+  } while (number != 0);
+  return end;
 }
 
-void WebServer::httpUnauthorized()
+char *WebServer::formatFixed(char *end, unsigned long whole,
+                             unsigned long fraction, uint8_t decimals)
 {
-  P(unauthMsg1) = "HTTP/1.0 401 Authorization Required" CRLF;
-  printP(unauthMsg1);
+  if (decimals > 0)
+  {
+    while (decimals-- > 0)
+    {
+      *--end = '0' + fraction % 10;
+      fraction /= 10;
+    }
+    *--end = '.';
+  }
+  return formatDecimal(end, whole);
+}
 
-#ifndef WEBDUINO_SUPRESS_SERVER_HEADER
-  printP(webServerHeader);
-#endif
+void WebServer::printInt(long number)
+{
+  char buf[11];
+  char *end = buf + sizeof(buf);
+  char *start = formatDecimal(end, (number < 0) ? -(unsigned long)number : number);
+  if (number < 0)
+    *--start = '-';
+  write((const uint8_t *)start, end - start);
+}
 
-  P(unauthMsg2) = 
-    "Content-Type: text/html" CRLF
-    "WWW-Authenticate: Basic realm=\"" WEBDUINO_AUTH_REALM "\"" CRLF
-    CRLF
-    WEBDUINO_AUTH_MESSAGE;
+void WebServer::printUInt(unsigned long number)
+{
+  char buf[10];
+  char *end = buf + sizeof(buf);
+  char *start = formatDecimal(end, number);
+  write((const uint8_t *)start, end - start);
+}
 
-  printP(unauthMsg2);
+void WebServer::printHex(unsigned long number, uint8_t digits)
+{
+  char buf[8];
+  char *end = buf + sizeof(buf);
+  char *start = formatHex(end, number);
+  if (digits > sizeof(buf))
+    digits = sizeof(buf);
+  while (end - start < digits)
+    *--start = '0';
+  write((const uint8_t *)start, end - start);
 }
 
-void WebServer::httpServerError()
+void WebServer::printFixed(long number, uint8_t decimals)
 {
-  P(servErrMsg1) = "HTTP/1.0 500 Internal Server Error" CRLF;
-  printP(servErrMsg1);
+  char buf[21];
+  char *end = buf + sizeof(buf);
+  unsigned long magnitude = (number < 0) ? -(unsigned long)number : number;
+  if (decimals > 9)
+    decimals = 9;
+  unsigned long scale = 1;
+  for (uint8_t i = 0; i < decimals; ++i)
+    scale *= 10;
+  char *start = formatFixed(end, magnitude / scale, magnitude % scale, decimals);
+  if (number < 0)
+    *--start = '-';
+  write((const uint8_t *)start, end - start);
+}
 
-#ifndef WEBDUINO_SUPRESS_SERVER_HEADER
-  printP(webServerHeader);
-#endif
+void WebServer::renderTemplate(const unsigned char *tpl, TemplateCommand *cmd)
+{
+  const unsigned char *run = tpl;
+  uint8_t ch;
+  while ((ch = pgm_read_byte(tpl)) != 0)
+  {
+    if (ch != '{' || pgm_read_byte(tpl + 1) != '{')
+    {
+      ++tpl;
+      continue;
+    }
 
-  P(servErrMsg2) = 
-    "Content-Type: text/html" CRLF
-    CRLF
-    WEBDUINO_SERVER_ERROR_MESSAGE;
+    // hash the name up to the closing braces like slot does
+    const unsigned char *name = tpl + 2;
+    uint32_t hash = HASH_START;
+    while ((ch = pgm_read_byte(name)) != 0 &&
+           (ch != '}' || pgm_read_byte(name + 1) != '}'))
+    {
+      if (ch != ' ')
+        hash = hashChar(hash, lowerCase(ch));
+      ++name;
+    }
+    // without them the rest of the template is just text
+    if (ch == 0)
+    {
+      tpl = name;
+      break;
+    }
 
-  printP(servErrMsg2);
+    writeP(run, tpl - run);
+    cmd(*this, hash);
+    tpl = run = name + 2;
+  }
+  writeP(run, tpl - run);
 }
 
-void WebServer::httpNoContent()
+void WebServer::renderSlots(const unsigned char *tpl, const TemplateSlot *slots,
+                            TemplateCommand *cmd)
 {
-  P(noContentMsg1) = "HTTP/1.0 204 NO CONTENT" CRLF;
-  printP(noContentMsg1);
+  uint16_t at = 0;
+  for (;; ++slots)
+  {
+    uint16_t start = pgm_read_word(&slots->start);
+    writeP(tpl + at, start - at);
+    if (start == pgm_read_word(&slots->end))
+      break;
+    cmd(*this, pgm_read_dword(&slots->slot));
+    at = pgm_read_word(&slots->end);
+  }
+}
 
-#ifndef WEBDUINO_SUPRESS_SERVER_HEADER
-  printP(webServerHeader);
-#endif
+bool WebServer::dispatchCommand(ConnectionType requestType, char *verb,
+        bool tail_complete)
+{
+  P(rootRoute) = "";
+  // if there is no URL, i.e. we have a prefix and it's requested without a
+  // trailing slash or if the URL is just the slash
+  if ((verb[0] == 0) || ((verb[0] == '/') && (verb[1] == 0)))
+  {
+    metricsRoute(rootRoute);
+    m_defaultCmd(*this, requestType, (char*)"", tail_complete);
+    return true;
+  }
+  // if the URL is just a slash followed by a question mark
+  // we're looking at the default command with GET parameters passed
+  if ((verb[0] == '/') && (verb[1] == '?'))
+  {
+    verb+=2; // skip over the "/?" part of the url
+    metricsRoute(rootRoute);
+    m_defaultCmd(*this, requestType, verb, tail_complete);
+    return true;
+  }
+  // We now know that the URL contains at least one character.  And,
+  // if the first character is a slash,  there's more after it.
+  if (verb[0] == '/')
+  {
+    uint8_t i;
+    char *qm_loc;
+    uint16_t verb_len;
+    uint8_t qm_offset;
+    // Skip over the leading "/",  because it makes the code more
+    // efficient and easier to understand.
+    verb++;
+    // Look for a "?" separating the filename part of the URL from the
+    // parameters.  If it's not there, compare to the whole URL.
+    qm_loc = strchr(verb, '?');
+    verb_len = (qm_loc == NULL) ? strlen(verb) : (qm_loc - verb);
+    qm_offset = (qm_loc == NULL) ? 0 : 1;
+    for (i = 0; i < m_cmdCount; ++i)
+    {
+      if ((verb_len == strlen(m_commands[i].verb))
+          && (strncmp(verb, m_commands[i].verb, verb_len) == 0))
+      {
+        // Skip over the "verb" part of the URL (and the question
+        // mark, if present) when passing it to the "action" routine
+        metricsRoute(m_commands[i].verb, false);
+        m_commands[i].cmd(*this, requestType,
+        verb + verb_len + qm_offset,
+        tail_complete);
+        return true;
+      }
+    }
+    // the route table is sorted, so a binary search finds the verb
+    // with a handful of comparisons however many routes there are
+    const Route *route = findEntry(m_routes, m_routeCount, verb, verb_len);
+    if (route != NULL)
+    {
+      metricsRoute(route->verb, true);
+      Command *cmd = (Command *)pgm_read_ptr(&route->cmd);
+      cmd(*this, requestType, verb + verb_len + qm_offset, tail_complete);
+      return true;
+    }
+    if (requestType == GET || requestType == HEAD)
+    {
+      const Asset *asset = findEntry(m_assets, m_assetCount, verb, verb_len);
+      if (asset != NULL)
+      {
+        metricsRoute(asset->verb, true);
+        sendAsset(requestType, asset);
+        return true;
+      }
+      if (m_fileStore != NULL && dispatchFile(requestType, verb, verb_len))
+      {
+        P(filesRoute) = "(files)";
+        metricsRoute(filesRoute);
+        return true;
+      }
+    }
+    // Check if UrlPathCommand is assigned.
+    if (m_urlPathCmd != NULL)
+    {
+      P(urlPathRoute) = "(url path)";
+      metricsRoute(urlPathRoute);
+      // Initialize with null bytes, so number of parts can be determined.
+      char *url_path[WEBDUINO_URL_PATH_COMMAND_LENGTH] = {0};
+      uint8_t part = 0;
 
-  P(noContentMsg2) = 
-    CRLF
-    CRLF;
+      // URL path should be terminated with null byte.
+      *(verb + verb_len) = 0;
 
-  printP(noContentMsg2);
+      // First URL path part is at the start of verb.
+      url_path[part++] = verb;
+      // Replace all slashes ('/') with a null byte so every part of the URL
+      // path is a seperate string. Add every char following a '/' as a new
+      // part of the URL, even if that char is a '/' (which will be replaced
+      // with a null byte).
+      for (char * p = verb; p < verb + verb_len; p++)
+      {
+        if (*p == '/')
+        {
+          *p = 0;
+          url_path[part++] = p + 1;
+          // Don't try to assign out of array bounds.
+          if (part == WEBDUINO_URL_PATH_COMMAND_LENGTH) break;
+        }
+      }
+      m_urlPathCmd(*this, requestType, url_path,
+                   verb + verb_len + qm_offset, tail_complete);
+      return true;
+    }
+  }
+  return false;
 }
 
-void WebServer::httpSuccess(const char *contentType,
-                            const char *extraHeaders)
+void WebServer::processConnection(char *buff, int *bufflen)
 {
-  P(successMsg1) = "HTTP/1.0 200 OK" CRLF;
-  printP(successMsg1);
+  processConnection();
+}
 
-#ifndef WEBDUINO_SUPRESS_SERVER_HEADER
-  printP(webServerHeader);
+void WebServer::processConnection()
+{
+#if WEBDUINO_EVENT_STREAMS
+  serveEventStreams();
+#endif
+#if WEBDUINO_WEBSOCKETS
+  serveWebSockets();
 #endif
 
-  P(successMsg2) = 
-    "Access-Control-Allow-Origin: *" CRLF
-    "Content-Type: ";
+#if WEBDUINO_NONBLOCKING
+  acceptConnection();
 
-  printP(successMsg2);
-  print(contentType);
-  printCRLF();
-  if (extraHeaders)
-    print(extraHeaders);
-  printCRLF();
-}
+  // make progress on every connection we're serving, running the
+  // handler of each request that is complete by now
+  for (uint8_t i = 0; i < SIZE(m_connections); ++i)
+  {
+    m_conn = &m_connections[i];
+    if (!m_conn->client || !parseRequest())
+      continue;
 
-void WebServer::httpSeeOther(const char *otherURL)
-{
-  P(seeOtherMsg1) = "HTTP/1.0 303 See Other" CRLF;
-  printP(seeOtherMsg1);
+    bool tail_complete;
+    char *url = requestURL(&tail_complete);
+    if (m_conn->requestType != INVALID)
+      m_conn->readingContent = true;
+    handleRequest(m_conn->requestType, url, tail_complete);
+  }
+#else
+  m_conn->client = m_server.available();
 
-#ifndef WEBDUINO_SUPRESS_SERVER_HEADER
-  printP(webServerHeader);
+  if (!m_conn->client)
+    return;
+
+  // run the same parser as the non-blocking mode, only waiting for
+  // each character
+  startRequest();
+#if WEBDUINO_SERIAL_DEBUGGING > 1
+  Serial.println("*** checking request ***");
 #endif
 
-  P(seeOtherMsg2) = "Location: ";
-  printP(seeOtherMsg2);
-  print(otherURL);
-  printCRLF();
-  printCRLF();
+  // the parser stops right away at invalid requests.
+  // this is done to prevent Webduino from hanging
+  // - when there are illegal requests,
+  // - when someone contacts it through telnet rather than proper HTTP,
+  // - etc.
+  int ch;
+  while (m_conn->parseState != PARSE_BODY && (ch = read()) != -1)
+    parseRequestChar(ch);
+  bool tail_complete;
+  char *url = requestURL(&tail_complete);
+#if WEBDUINO_SERIAL_DEBUGGING > 1
+  Serial.print("*** requestType = ");
+  Serial.print((int)m_conn->requestType);
+  Serial.print(", request = \"");
+  Serial.print(url);
+  Serial.println("\" ***");
+#endif
+
+  if (m_conn->parseState == PARSE_BODY && m_conn->requestType != INVALID)
+  {
+#if WEBDUINO_SERIAL_DEBUGGING > 1
+    Serial.println("*** headers complete ***");
+#endif
+    m_conn->readingContent = true;
+  }
+  handleRequest(m_conn->requestType, url, tail_complete);
+#endif
 }
 
-int WebServer::read()
+// Run the command matching a fully parsed request line, then send
+// what's left of the output and close the connection.
+void WebServer::handleRequest(ConnectionType requestType, char *buff,
+                              bool tail_complete)
 {
-  if (!m_client)
-    return -1;
+  int urlPrefixLen = strlen(m_urlPrefix);
 
-  if (m_pushbackDepth == 0)
+#if WEBDUINO_KEEP_ALIVE
+  m_conn->responseFramed = false;
+#endif
+#if WEBDUINO_CHUNKED_ENCODING
+  m_conn->chunkState = CHUNKS_OFF;
+#endif
+#if WEBDUINO_METRICS
+  unsigned long handlerStart = micros();
+  addTime(m_phaseTime[PHASE_PARSE], handlerStart - m_conn->started);
+  m_metricsRoute = &m_routeMetrics[SIZE(m_routeMetrics) - 1];
+#endif
+#if WEBDUINO_RESPONSE_CACHE
+  m_cacheURL = NULL;
+  m_cacheTtl = 0;
+#endif
+
+  // handlers aren't run on a URL or credentials that were cut short
+  if (requestType != INVALID && (!tail_complete || m_conn->headerClipped))
+    httpTooLong(!tail_complete);
+  else if (requestType != INVALID && strcmp(buff, "/robots.txt") == 0)
   {
-    unsigned long timeoutTime = millis() + WEBDUINO_READ_TIMEOUT_IN_MS;
+    P(robotsRoute) = "robots.txt";
+    metricsRoute(robotsRoute);
+    noRobots(requestType);
+  }
+  else if (requestType != INVALID && strcmp(buff, "/favicon.ico") == 0)
+  {
+    P(faviconRoute) = "favicon.ico";
+    metricsRoute(faviconRoute);
+    favicon(requestType);
+  }
+#if WEBDUINO_METRICS
+  else if (requestType != INVALID && strcmp(buff, WEBDUINO_METRICS_PATH) == 0)
+  {
+    P(metricsPath) = WEBDUINO_METRICS_PATH;
+    metricsRoute(metricsPath + 1);
+    metrics(requestType);
+  }
+#endif
+#if WEBDUINO_RESPONSE_CACHE
+  else if (requestType == GET && sendCached(buff))
+  {
+    // the response kept for the URL with cacheResponse was sent again
+  }
+#endif
+  // Only try to dispatch command if request type and prefix are correct.
+  // Fix by quarencia.
+  else if (requestType == INVALID ||
+           strncmp(buff, m_urlPrefix, urlPrefixLen) != 0)
+  {
+    m_failureCmd(*this, requestType, buff, tail_complete);
+  }
+  else if (!dispatchCommand(requestType, buff + urlPrefixLen,
+           tail_complete))
+  {
+    m_failureCmd(*this, requestType, buff, tail_complete);
+  }
+#if WEBDUINO_METRICS
+  addTime(m_phaseTime[PHASE_HANDLER], micros() - handlerStart);
+#endif
+#if WEBDUINO_RESPONSE_CACHE
+  if (m_caching)
+    endCaching();
+#endif
+
+#if WEBDUINO_CHUNKED_ENCODING
+  if (m_conn->chunkState == CHUNKS_ON)
+  {
+    sendChunk(true);
+    m_conn->chunkState = CHUNKS_OFF;
+    m_conn->bufFill = 0;
+  }
+#endif
+  flushBuf();
+#if WEBDUINO_METRICS
+  countRequest();
+#endif
 
-    while (m_client.connected())
+#if WEBDUINO_KEEP_ALIVE
+  if (m_conn->keepAlive && m_conn->responseFramed)
+  {
+    if (m_conn->client.connected())
     {
-      // stop reading the socket early if we get to content-length
-      // characters in the POST.  This is because some clients leave
-      // the socket open because they assume HTTP keep-alive.
-      if (m_readingContent)
-      {
-        if (m_contentLength == 0)
-        {
 #if WEBDUINO_SERIAL_DEBUGGING > 1
-          Serial.println("\n*** End of content, terminating connection");
+      Serial.println("*** keeping connection open ***");
+#endif
+      // whatever the handler left of the body is skipped by
+      // parseRequest as it comes in, rather than waited for here, so
+      // the next request starts at the right place.  What was pushed
+      // back was part of it too.
+      long skip = m_conn->readingContent ? m_conn->contentLength : 0;
+      m_pushbackDepth = 0;
+      ++m_conn->requests;
+      startRequest();
+      m_conn->skip = skip;
+      return;
+    }
+  }
 #endif
-          return -1;
-        }
-      }
 
-      int ch = m_client.read();
+#if WEBDUINO_SERIAL_DEBUGGING > 1
+  Serial.println("*** stopping connection ***");
+#endif
+  reset();
+}
 
-      // if we get a character, return it, otherwise continue in while
-      // loop, checking connection status
-      if (ch != -1)
-      {
-        // count character against content-length
-        if (m_readingContent)
-        {
-          --m_contentLength;
-        }
+bool WebServer::checkCredentials(const char authCredentials[45])
+{
+  char basic[7] = "Basic ";
+  const char *received = m_conn->arena + m_conn->authAt;
+  if((0 == strncmp(received,basic,6)) &&
+     (0 == strcmp(authCredentials, received + 6))) return true;
+  return false;
+}
 
-#if WEBDUINO_SERIAL_DEBUGGING
-        if (ch == '\r')
-          Serial.print("<CR>");
-        else if (ch == '\n')
-          Serial.println("<LF>");
-        else
-          Serial.print((char)ch);
+// Output the status line and the headers every response starts with.
+// contentLength is the length of the body that follows, or one of
+// LENGTH_UNKNOWN and LENGTH_NO_BODY.
+void WebServer::printStatus(const unsigned char *status, long contentLength)
+{
+#if WEBDUINO_KEEP_ALIVE
+  P(versionMsg) = "HTTP/1.1 ";
+#else
+  P(versionMsg) = "HTTP/1.0 ";
 #endif
-        return ch;
-      }
-      else
-      {
-        unsigned long now = millis();
-        if (now > timeoutTime)
-        {
-          // connection timed out, destroy client, return EOF
-#if WEBDUINO_SERIAL_DEBUGGING
-          Serial.println("*** Connection timed out");
+  printP(versionMsg);
+  printP(status);
+  printCRLF();
+#if WEBDUINO_METRICS
+  m_conn->failed = pgm_read_byte(status) >= '4';
 #endif
-          reset();
-          return -1;
-        }
-      }
+
+#ifndef WEBDUINO_SUPRESS_SERVER_HEADER
+  printP(webServerHeader);
+#endif
+
+  printValidators();
+
+  if (contentLength >= 0)
+  {
+    P(contentLengthMsg) = "Content-Length: ";
+    printP(contentLengthMsg);
+    printInt(contentLength);
+    printCRLF();
+  }
+
+#if WEBDUINO_KEEP_ALIVE
+  // without a length, only the end of the connection can tell the
+  // client where the body ends
+  m_conn->responseFramed = contentLength != LENGTH_UNKNOWN ||
+                           m_conn->requestType == HEAD;
+  if (m_conn->requests + 1 >= WEBDUINO_KEEP_ALIVE_MAX_REQUESTS)
+    m_conn->keepAlive = false;
+
+#if WEBDUINO_CHUNKED_ENCODING
+  // unless the body is sent in chunks, which HTTP/1.1 clients know
+  if (!m_conn->responseFramed && m_conn->keepAlive && m_conn->http11)
+  {
+    P(chunkedMsg) = "Transfer-Encoding: chunked" CRLF;
+    printP(chunkedMsg);
+    m_conn->chunkState = CHUNKS_PENDING;
+    m_conn->responseFramed = true;
+  }
+#endif
+
+  if (m_conn->keepAlive && m_conn->responseFramed)
+  {
+    // HTTP/1.1 clients assume this anyway
+    if (!m_conn->http11)
+    {
+      P(keepAliveMsg) = "Connection: keep-alive" CRLF;
+      printP(keepAliveMsg);
     }
+  }
+  else
+  {
+    P(closeMsg) = "Connection: close" CRLF;
+    printP(closeMsg);
+  }
+#endif
 
-    // connection lost, return EOF
-#if WEBDUINO_SERIAL_DEBUGGING
-    Serial.println("*** Connection lost");
+#if WEBDUINO_RESPONSE_CACHE
+  if (m_cacheTtl != 0)
+    startCaching(status);
 #endif
-    return -1;
+}
+
+// Output the empty line that ends the headers.
+void WebServer::endHeaders()
+{
+  printCRLF();
+#if WEBDUINO_RESPONSE_CACHE
+  if (m_caching && m_cached[m_cachedCount].headLen == 0)
+    m_cached[m_cachedCount].headLen = m_cached[m_cachedCount].length;
+#endif
+
+#if WEBDUINO_CHUNKED_ENCODING
+  if (m_conn->chunkState == CHUNKS_PENDING)
+  {
+    // keep room for the size line of the first chunk behind the
+    // headers, so both can go out together
+    if (m_conn->bufFill + CHUNK_HEADER_SIZE + 2 >= (int)sizeof(m_conn->buffer))
+      flushBuf();
+    m_conn->chunkStart = m_conn->bufFill;
+    m_conn->bufFill += CHUNK_HEADER_SIZE;
+    m_conn->chunkState = CHUNKS_ON;
+  }
+#endif
+}
+
+void WebServer::httpFail()
+{
+  P(failMsg1) = "400 Bad Request";
+  printStatus(failMsg1, sizeof(WEBDUINO_FAIL_MESSAGE) - 1);
+
+  P(failMsg2) = 
+    "Content-Type: text/html" CRLF
+    CRLF
+    WEBDUINO_FAIL_MESSAGE;
+
+  printP(failMsg2);
+}
+
+// Answer a request whose URL, or a header value it needs, was too long
+// for the arena.
+void WebServer::httpTooLong(bool url)
+{
+#if WEBDUINO_KEEP_ALIVE
+  // with the arena full, the headers after the cut, like the length of
+  // the body, may not have been checked, so the connection isn't kept
+  m_conn->keepAlive = false;
+#endif
+  P(uriMsg1) = "414 URI Too Long";
+  P(headerMsg1) = "431 Request Header Fields Too Large";
+  printStatus(url ? uriMsg1 : headerMsg1, sizeof(WEBDUINO_FAIL_MESSAGE) - 1);
+
+  P(tooLongMsg2) =
+    "Content-Type: text/html" CRLF
+    CRLF
+    WEBDUINO_FAIL_MESSAGE;
+
+  printP(tooLongMsg2);
+}
+
+void WebServer::defaultFailCmd(WebServer &server,
+                               WebServer::ConnectionType type,
+                               char *url_tail,
+                               bool tail_complete)
+{
+  server.httpFail();
+}
+
+void WebServer::noRobots(ConnectionType type)
+{
+  P(allowNoneMsg) = "User-agent: *" CRLF "Disallow: /" CRLF;
+  httpSuccess("text/plain", NULL, sizeof(allowNoneMsg) - 1);
+  if (type != HEAD)
+  {
+    printP(allowNoneMsg);
+  }
+}
+
+void WebServer::favicon(ConnectionType type)
+{
+  P(faviconIco) = WEBDUINO_FAVICON_DATA;
+  httpSuccess("image/x-icon","Cache-Control: max-age=31536000\r\n",
+              sizeof(faviconIco));
+  if (type != HEAD)
+  {
+    writeP(faviconIco, sizeof(faviconIco));
+  }
+}
+
+#if WEBDUINO_METRICS
+void WebServer::metricsRoute(const char *name, bool progmem)
+{
+  // the last entry is left for the routes that find no free one
+  for (uint8_t i = 0; i < SIZE(m_routeMetrics) - 1; ++i)
+  {
+    RouteMetrics &route = m_routeMetrics[i];
+    if (route.name == NULL)
+    {
+      route.name = name;
+      route.progmem = progmem;
+    }
+    if (route.name == name)
+    {
+      m_metricsRoute = &route;
+      return;
+    }
   }
+  m_metricsRoute = &m_routeMetrics[SIZE(m_routeMetrics) - 1];
+}
+
+// Add the request that was just answered to the counts of its route.
+void WebServer::countRequest()
+{
+  RouteMetrics &route = *m_metricsRoute;
+  unsigned long us = micros() - m_conn->started;
+
+  ++route.requests;
+  if (m_conn->failed)
+    ++route.failures;
+  route.bytesIn += m_conn->bytesIn;
+  route.bytesOut += m_conn->bytesOut;
+  addTime(route.time, us);
+
+  uint8_t bucket = 0;
+  while (bucket < WEBDUINO_METRICS_BUCKETS && us > (1000UL << bucket))
+    ++bucket;
+  ++route.buckets[bucket];
+
+  // what comes after this on a connection kept open belongs to the
+  // next request
+  m_conn->bytesIn = 0;
+  m_conn->bytesOut = 0;
+}
+
+void WebServer::addTime(MetricsTime &time, unsigned long us)
+{
+  us += time.us;
+  time.ms += us / 1000;
+  time.us = us % 1000;
+}
+
+// Output a time in seconds, to the microsecond, and end the line.
+void WebServer::printTime(const MetricsTime &time)
+{
+  printUInt(time.ms / 1000);
+  printf(".%03u%03u\n", (unsigned)(time.ms % 1000), time.us);
+}
+
+// Output the name of a metric and the label of a route, leaving the
+// labels open for more.  Verbs get the slash they have in the URL.
+void WebServer::printRouteLabel(const unsigned char *metric,
+                                const RouteMetrics &route)
+{
+  printP(metric);
+  if (route.name == NULL)
+    printf(F("{route=\"(other)\""));
+  else if (route.progmem)
+    printf(F("{route=\"%s%S\""),
+           pgm_read_byte(route.name) == '(' ? "" : "/", route.name);
   else
-    return m_pushback[--m_pushbackDepth];
+    printf(F("{route=\"/%s\""), route.name);
 }
 
-void WebServer::push(int ch)
+// Output one counter of each route that has been requested.
+void WebServer::printRouteCounter(const unsigned char *metric,
+                                  uint32_t RouteMetrics::*counter)
 {
-  // don't allow pushing EOF
-  if (ch == -1)
+  printf(F("# TYPE %S counter\n"), metric);
+  for (uint8_t i = 0; i < SIZE(m_routeMetrics); ++i)
+  {
+    const RouteMetrics &route = m_routeMetrics[i];
+    if (route.requests == 0)
+      continue;
+    printRouteLabel(metric, route);
+    printf(F("} %lu\n"), (unsigned long)(route.*counter));
+  }
+}
+
+// Serve the counts in the text format Prometheus scrapes.  The lines
+// of a metric have to come together, so the routes are gone through
+// once for each.
+void WebServer::metrics(ConnectionType type)
+{
+  httpSuccess("text/plain; version=0.0.4");
+  if (type == HEAD)
     return;
 
-  m_pushback[m_pushbackDepth++] = ch;
-  // can't raise error here, so just replace last char over and over
-  if (m_pushbackDepth == SIZE(m_pushback))
-    m_pushbackDepth = SIZE(m_pushback) - 1;
+  P(requestsMetric) = "webduino_requests_total";
+  P(failuresMetric) = "webduino_request_failures_total";
+  P(receivedMetric) = "webduino_received_bytes_total";
+  P(sentMetric) = "webduino_sent_bytes_total";
+  printRouteCounter(requestsMetric, &RouteMetrics::requests);
+  printRouteCounter(failuresMetric, &RouteMetrics::failures);
+  printRouteCounter(receivedMetric, &RouteMetrics::bytesIn);
+  printRouteCounter(sentMetric, &RouteMetrics::bytesOut);
+
+  P(durationBucket) = "webduino_request_duration_seconds_bucket";
+  P(durationSum) = "webduino_request_duration_seconds_sum";
+  P(durationCount) = "webduino_request_duration_seconds_count";
+  printf(F("# TYPE webduino_request_duration_seconds histogram\n"));
+  for (uint8_t i = 0; i < SIZE(m_routeMetrics); ++i)
+  {
+    const RouteMetrics &route = m_routeMetrics[i];
+    if (route.requests == 0)
+      continue;
+    // the buckets count the requests up to their limit, so each
+    // includes the ones before it
+    uint32_t requests = 0;
+    for (uint8_t bucket = 0; bucket <= WEBDUINO_METRICS_BUCKETS; ++bucket)
+    {
+      requests += route.buckets[bucket];
+      printRouteLabel(durationBucket, route);
+      printf(F(",le=\""));
+      if (bucket < WEBDUINO_METRICS_BUCKETS)
+        printFixed(1L << bucket, 3);
+      else
+        printf(F("+Inf"));
+      printf(F("\"} %lu\n"), (unsigned long)requests);
+    }
+    printRouteLabel(durationSum, route);
+    printf(F("} "));
+    printTime(route.time);
+    printRouteLabel(durationCount, route);
+    printf(F("} %lu\n"), (unsigned long)route.requests);
+  }
+
+  printf(F("# TYPE webduino_timeouts_total counter\n"
+           "webduino_timeouts_total %lu\n"
+           "# TYPE webduino_phase_seconds_total counter\n"),
+         (unsigned long)m_timeouts);
+  P(phases) = "parse\0handler\0send";
+  const char *phase = (const char *)phases;
+  for (uint8_t i = 0; i < PHASE_COUNT; ++i)
+  {
+    printf(F("webduino_phase_seconds_total{phase=\"%S\"} "), phase);
+    printTime(m_phaseTime[i]);
+    phase += strlen_P(phase) + 1;
+  }
 }
+#endif
 
-void WebServer::reset()
+void WebServer::httpUnauthorized()
 {
-  m_pushbackDepth = 0;
-  m_client.flush();
-  m_client.stop();
+  P(unauthMsg1) = "401 Authorization Required";
+  printStatus(unauthMsg1, sizeof(WEBDUINO_AUTH_MESSAGE) - 1);
+
+  P(unauthMsg2) = 
+    "Content-Type: text/html" CRLF
+    "WWW-Authenticate: Basic realm=\"" WEBDUINO_AUTH_REALM "\"" CRLF
+    CRLF
+    WEBDUINO_AUTH_MESSAGE;
+
+  printP(unauthMsg2);
 }
 
-bool WebServer::expect(const char *str)
+void WebServer::httpServerError()
 {
-  const char *curr = str;
-  while (*curr != 0)
+  P(servErrMsg1) = "500 Internal Server Error";
+  printStatus(servErrMsg1, sizeof(WEBDUINO_SERVER_ERROR_MESSAGE) - 1);
+
+  P(servErrMsg2) = 
+    "Content-Type: text/html" CRLF
+    CRLF
+    WEBDUINO_SERVER_ERROR_MESSAGE;
+
+  printP(servErrMsg2);
+}
+
+void WebServer::httpNotModified()
+{
+  P(notModifiedMsg) = "304 Not Modified";
+  printStatus(notModifiedMsg, LENGTH_NO_BODY);
+  endHeaders();
+}
+
+bool WebServer::notModified(uint32_t etag, uint32_t lastModified)
+{
+  m_conn->etag = etag;
+  m_conn->lastModified = lastModified;
+
+#if WEBDUINO_CONDITIONAL_REQUESTS
+  // If-Modified-Since only counts when there's no If-None-Match
+  bool current;
+  if (m_conn->conditions & IF_NONE_MATCH)
+    current = (m_conn->conditions & IF_NONE_MATCH_ANY) ||
+              (etag != 0 && etag == m_conn->ifNoneMatch);
+  else
+    current = lastModified != 0 && m_conn->ifModifiedSince != 0 &&
+              lastModified <= m_conn->ifModifiedSince;
+
+  if (current)
+    httpNotModified();
+  return current;
+#else
+  return false;
+#endif
+}
+
+bool WebServer::range(uint32_t length, uint32_t &first, uint32_t &last)
+{
+#if !WEBDUINO_CONDITIONAL_REQUESTS
+  return false;
+#else
+  if (!(m_conn->conditions & RANGE) || length == 0)
+    return false;
+
+  // if what the client has part of has changed since, it needs all of it
+  if (m_conn->conditions & IF_RANGE)
   {
-    int ch = read();
-    if (ch != *curr++)
-    {
-      // push back ch and the characters we accepted
-      push(ch);
-      while (--curr != str)
-        push(curr[-1]);
+    uint32_t current = (m_conn->conditions & IF_RANGE_DATE) ?
+                       m_conn->lastModified : m_conn->etag;
+    if (current == 0 || current != m_conn->ifRange)
+      return false;
+  }
+
+  uint32_t from, to;
+  if (m_conn->conditions & RANGE_SUFFIX)
+  {
+    if (m_conn->rangeLast == 0)
       return false;
+    from = (m_conn->rangeLast < length) ? length - m_conn->rangeLast : 0;
+    to = length - 1;
+  }
+  else
+  {
+    from = m_conn->rangeFirst;
+    to = (m_conn->rangeLast < length) ? m_conn->rangeLast : length - 1;
+  }
+
+  // ranges that can't be served are ignored, as they may be
+  if (from > to)
+    return false;
+  first = from;
+  last = to;
+  return true;
+#endif
+}
+
+// Output the Content-Range header of a 206 response.
+void WebServer::printContentRange(uint32_t first, uint32_t last,
+                                  uint32_t length)
+{
+  P(contentRangeMsg) = "Content-Range: bytes ";
+  printP(contentRangeMsg);
+  printUInt(first);
+  write('-');
+  printUInt(last);
+  write('/');
+  printUInt(length);
+  printCRLF();
+}
+
+void WebServer::httpPartialContent(const char *contentType,
+                                   uint32_t first, uint32_t last,
+                                   uint32_t length)
+{
+  P(partialMsg1) = "206 Partial Content";
+  printStatus(partialMsg1, last - first + 1);
+  printContentRange(first, last, length);
+
+  P(partialMsg2) = 
+    "Access-Control-Allow-Origin: *" CRLF
+    "Content-Type: ";
+  printP(partialMsg2);
+  print(contentType);
+  printCRLF();
+  endHeaders();
+}
+
+void WebServer::httpNoContent()
+{
+  P(noContentMsg1) = "204 NO CONTENT";
+  printStatus(noContentMsg1, LENGTH_NO_BODY);
+
+  printCRLF();
+}
+
+// Output the headers of a response with something length bytes long,
+// or the part of it the request asks for, and set first and last to
+// the bytes that are to be sent.  More headers can follow.
+void WebServer::printStaticHeaders(const unsigned char *contentType,
+                                   uint32_t length,
+                                   uint32_t &first, uint32_t &last)
+{
+  first = 0;
+  last = length - 1;
+  if (range(length, first, last))
+  {
+    P(staticPartialMsg) = "206 Partial Content";
+    printStatus(staticPartialMsg, last - first + 1);
+    printContentRange(first, last, length);
+  }
+  else
+  {
+    P(staticMsg1) = "200 OK";
+    printStatus(staticMsg1, length);
+  }
+
+  P(staticMsg2) = 
+    "Accept-Ranges: bytes" CRLF
+    "Access-Control-Allow-Origin: *" CRLF
+    "Content-Type: ";
+  printP(staticMsg2);
+  printP(contentType);
+  printCRLF();
+}
+
+// Serve a file if the verb is below the prefix set with serveFiles.
+bool WebServer::dispatchFile(ConnectionType type, char *path,
+                             uint16_t path_len)
+{
+  uint16_t prefixLen = strlen(m_filePrefix);
+  if (prefixLen > 0)
+  {
+    if (path_len < prefixLen || strncmp(path, m_filePrefix, prefixLen) != 0)
+      return false;
+    path += prefixLen;
+    path_len -= prefixLen;
+    if (path_len > 0 && *path != '/')
+      return false;
+  }
+  while (path_len > 0 && *path == '/')
+  {
+    ++path;
+    --path_len;
+  }
+
+  // undo the URL encoding, and add the index file's name to directories
+  char file[WEBDUINO_FILE_PATH_LENGTH];
+  uint8_t len = 0;
+  for (uint16_t i = 0; i < path_len; ++i)
+  {
+    char ch = path[i];
+    if (ch == '%' && i + 2 < path_len)
+    {
+      char hex[3] = { path[i + 1], path[i + 2], 0 };
+      ch = strtoul(hex, NULL, 16);
+      i += 2;
+    }
+    if (len >= sizeof(file) - 1)
+      return false;
+    file[len++] = ch;
+  }
+  if (len == 0 || file[len - 1] == '/')
+  {
+    if (len + sizeof(WEBDUINO_FILE_INDEX) > sizeof(file))
+      return false;
+    memcpy(file + len, WEBDUINO_FILE_INDEX, sizeof(WEBDUINO_FILE_INDEX));
+  }
+  else
+    file[len] = 0;
+
+  // don't let the URL reach outside the store
+  if (strstr(file, "..") != NULL)
+    return false;
+
+  return sendFile(type, m_fileStore, file);
+}
+
+bool WebServer::sendFile(ConnectionType type, FileStore *store,
+                         const char *path)
+{
+  if (!store->open(path))
+    return false;
+
+  uint32_t length = store->size();
+  uint32_t lastModified = store->lastModified();
+  // without a time, there's nothing to tell versions of the file apart
+  uint32_t etag = lastModified ? (lastModified * 2654435761UL) ^ length : 0;
+  if (notModified(etag, lastModified))
+  {
+    store->close();
+    return true;
+  }
+
+  uint32_t first, last;
+  printStaticHeaders(mimeType(path), length, first, last);
+  endHeaders();
+
+  if (type != HEAD && first <= last && store->seek(first))
+  {
+    // blocks bigger than the output buffer go straight to the socket,
+    // after the headers, and are kept by the response cache like any
+    // other body
+    uint8_t block[WEBDUINO_FILE_BLOCK_SIZE];
+    uint32_t left = last - first + 1;
+    while (left > 0)
+    {
+      int count = store->read(block, left < sizeof(block) ? left : sizeof(block));
+      if (count <= 0)
+        break;
+      write(block, count);
+      left -= count;
+    }
+  }
+  store->close();
+  return true;
+}
+
+// the content types of files, by extension
+P(mimeTypes) =
+  "htm\0text/html; charset=utf-8\0"
+  "html\0text/html; charset=utf-8\0"
+  "css\0text/css\0"
+  "js\0application/javascript\0"
+  "json\0application/json\0"
+  "txt\0text/plain\0"
+  "csv\0text/csv\0"
+  "xml\0text/xml\0"
+  "png\0image/png\0"
+  "jpg\0image/jpeg\0"
+  "jpeg\0image/jpeg\0"
+  "gif\0image/gif\0"
+  "ico\0image/x-icon\0"
+  "svg\0image/svg+xml\0"
+  "pdf\0application/pdf\0"
+  "\0application/octet-stream";
+
+// Guess the content type of a file from the extension of its name.
+const unsigned char *WebServer::mimeType(const char *path)
+{
+  const char *ext = strrchr(path, '.');
+  ext = (ext == NULL || strchr(ext, '/') != NULL) ? "" : ext + 1;
+
+  const unsigned char *entry = mimeTypes;
+  for (;;)
+  {
+    uint8_t extLen = strlen_P((const char *)entry);
+    const unsigned char *type = entry + extLen + 1;
+    if (extLen == 0 || strcasecmp_P(ext, (const char *)entry) == 0)
+      return type;
+    entry = type + strlen_P((const char *)type) + 1;
+  }
+}
+
+void WebServer::sendAsset(ConnectionType type, const Asset *asset)
+{
+  Asset a;
+  memcpy_P(&a, asset, sizeof(a));
+
+  // send the uncompressed copy only when there's one and it's needed
+  bool gzip = (a.data == NULL || m_conn->acceptGzip);
+  const unsigned char *data = gzip ? a.gzipData : a.data;
+  size_t length = gzip ? a.gzipLength : a.length;
+
+  // the two copies need different tags, as they differ byte for byte
+  if (a.etag != 0 && notModified(gzip ? ~a.etag : a.etag))
+    return;
+
+  uint32_t first, last;
+  printStaticHeaders(a.contentType, length, first, last);
+  if (gzip)
+  {
+    P(gzipMsg) = "Content-Encoding: gzip" CRLF;
+    printP(gzipMsg);
+  }
+  if (a.data != NULL)
+  {
+    // caches have to know the response depends on the request headers
+    P(varyMsg) = "Vary: Accept-Encoding" CRLF;
+    printP(varyMsg);
+  }
+  endHeaders();
+
+  if (type != HEAD)
+    writeP(data + first, last - first + 1);
+}
+
+void WebServer::httpSuccess(const char *contentType,
+                            const char *extraHeaders,
+                            long contentLength)
+{
+  P(successMsg1) = "200 OK";
+  printStatus(successMsg1, contentLength);
+
+  P(successMsg2) = 
+    "Access-Control-Allow-Origin: *" CRLF
+    "Content-Type: ";
+
+  printP(successMsg2);
+  print(contentType);
+  printCRLF();
+  if (extraHeaders)
+    print(extraHeaders);
+  endHeaders();
+}
+
+void WebServer::httpSeeOther(const char *otherURL)
+{
+  P(seeOtherMsg1) = "303 See Other";
+  printStatus(seeOtherMsg1, 0);
+
+  P(seeOtherMsg2) = "Location: ";
+  printP(seeOtherMsg2);
+  print(otherURL);
+  printCRLF();
+  printCRLF();
+}
+
+#if WEBDUINO_RESPONSE_CACHE
+void WebServer::cacheResponse(unsigned long ttl)
+{
+  m_cacheTtl = ttl;
+}
+
+// Send the response kept for url, if there's one that hasn't expired.
+// Responses are filed under the Authorization value of the request too,
+// so one sent to a client that passed checkCredentials never goes to a
+// client that didn't.  returns whether it was sent; if not, a copy of
+// url is put in the arena, as the handler may take url apart before
+// its response can be filed under it.
+bool WebServer::sendCached(const char *url)
+{
+  size_t urlLen = strlen(url);
+  const char *auth = cacheAuth();
+  size_t authLen = strlen(auth);
+  uint8_t i = 0;
+  while (i < m_cachedCount)
+  {
+    CachedResponse &c = m_cached[i];
+    if ((long)(millis() - c.expires) >= 0)
+    {
+      dropCached(i);
+      continue;
+    }
+    const uint8_t *key = m_cachePool + c.offset;
+    if (c.keyLen == urlLen + 1 + authLen &&
+        memcmp(key, url, urlLen + 1) == 0 &&
+        memcmp(key + urlLen + 1, auth, authLen) == 0)
+    {
+#if WEBDUINO_METRICS
+      m_metricsRoute = c.route;
+#endif
+      if ((c.etag != 0 || c.lastModified != 0) &&
+          notModified(c.etag, c.lastModified))
+        return true;
+
+      P(cachedMsg) = "200 OK";
+      printStatus(cachedMsg, c.length - c.headLen);
+      write(m_cachePool + c.offset + c.keyLen, c.length);
+      return true;
+    }
+    ++i;
+  }
+
+  for (const char *s = url; *s != 0; ++s)
+    arenaAdd(*s);
+  m_cacheURL = m_conn->arena + arenaKeep();
+  if (strlen(m_cacheURL) != urlLen)
+    m_cacheURL = NULL;
+  return false;
+}
+
+// Start keeping the response whose status line was just sent, after
+// the URL and the Authorization value of the request.
+void WebServer::startCaching(const unsigned char *status)
+{
+  unsigned long ttl = m_cacheTtl;
+  m_cacheTtl = 0;
+  // only complete 200 responses to GET requests, which have the copy
+  // of their URL, are worth keeping
+  if (m_cacheURL == NULL || strncmp_P("200", (const char *)status, 3) != 0)
+    return;
+  size_t urlLen = strlen(m_cacheURL);
+  const char *auth = cacheAuth();
+  size_t authLen = strlen(auth);
+  if (urlLen + 1 + authLen > 255)
+    return;
+
+  if (m_cachedCount == SIZE(m_cached))
+    dropCached(0);
+  CachedResponse &c = m_cached[m_cachedCount];
+  c.offset = cachedEnd();
+  c.keyLen = 0;
+  c.headLen = 0;
+  c.length = 0;
+  c.expires = ttl;
+  c.etag = m_conn->etag;
+  c.lastModified = m_conn->lastModified;
+#if WEBDUINO_METRICS
+  c.route = m_metricsRoute;
+#endif
+  m_caching = true;
+  cacheBytes((const uint8_t *)m_cacheURL, urlLen + 1, false);
+  cacheBytes((const uint8_t *)auth, authLen, false);
+
+  // older responses may have made room for it, moving it down
+  CachedResponse &kept = m_cached[m_cachedCount];
+  kept.keyLen = kept.length;
+  kept.length = 0;
+}
+
+// Add what's being sent to the response being kept, making room for
+// it if needed by letting go of the oldest ones.
+void WebServer::cacheBytes(const uint8_t *data, size_t size, bool progmem)
+{
+  if (!m_caching)
+    return;
+
+  while (cachedEnd() + size > sizeof(m_cachePool))
+  {
+    if (m_cachedCount == 0)
+    {
+      // too big to be kept at all
+      m_caching = false;
+      return;
+    }
+    dropCached(0);
+  }
+
+  uint8_t *end = m_cachePool + cachedEnd();
+  if (progmem)
+    memcpy_P(end, data, size);
+  else
+    memcpy(end, data, size);
+  m_cached[m_cachedCount].length += size;
+}
+
+// Keep the response the handler has sent, if all of it was collected.
+void WebServer::endCaching()
+{
+  m_caching = false;
+  CachedResponse &c = m_cached[m_cachedCount];
+  if (c.headLen == 0)
+    return;
+  c.expires += millis();
+  ++m_cachedCount;
+}
+
+// Let go of response i, moving the ones after it down in its place.
+void WebServer::dropCached(uint8_t i)
+{
+  uint16_t offset = m_cached[i].offset;
+  uint16_t size = m_cached[i].keyLen + m_cached[i].length;
+  uint16_t end = cachedEnd();
+  memmove(m_cachePool + offset, m_cachePool + offset + size,
+          end - offset - size);
+
+  // the one being collected moves along too
+  uint8_t count = m_cachedCount + (m_caching ? 1 : 0);
+  for (uint8_t j = i; j + 1 < count; ++j)
+  {
+    m_cached[j] = m_cached[j + 1];
+    m_cached[j].offset -= size;
+  }
+  --m_cachedCount;
+}
+
+// where the responses kept so far, and the one being collected, end
+uint16_t WebServer::cachedEnd()
+{
+  uint8_t count = m_cachedCount + (m_caching ? 1 : 0);
+  if (count == 0)
+    return 0;
+  const CachedResponse &c = m_cached[count - 1];
+  return c.offset + c.keyLen + c.length;
+}
+
+// the Authorization value of the request, or "" if it had none
+const char *WebServer::cacheAuth()
+{
+  return m_conn->authAt ? m_conn->arena + m_conn->authAt : "";
+}
+#endif
+
+#if WEBDUINO_EVENT_STREAMS
+bool WebServer::startEventStream()
+{
+  uint8_t i = 0;
+  while (i < SIZE(m_streams) && m_streams[i].client)
+    ++i;
+  if (m_conn->requestType != GET || i == SIZE(m_streams))
+    return false;
+
+  // the stream only ends with the connection
+#if WEBDUINO_KEEP_ALIVE
+  m_conn->keepAlive = false;
+#endif
+  P(eventStreamMsg1) = "200 OK";
+  printStatus(eventStreamMsg1, LENGTH_UNKNOWN);
+
+  P(eventStreamMsg2) =
+    "Access-Control-Allow-Origin: *" CRLF
+    "Content-Type: text/event-stream" CRLF
+    "Cache-Control: no-cache" CRLF;
+  printP(eventStreamMsg2);
+  endHeaders();
+  flushBuf();
+
+  // the socket is the stream's now, and is left alone when the
+  // handler is done
+  m_streams[i].client = m_conn->client;
+  m_streams[i].lastSent = millis();
+  m_conn->client = EthernetClient();
+  return true;
+}
+
+void WebServer::sendEvent(const char *name, const char *data)
+{
+  // the event is put together in a block on the stack, and sent to
+  // the streams whenever it fills
+  uint8_t event[WEBDUINO_EVENT_BLOCK_SIZE];
+  size_t fill = 0;
+
+  if (name != NULL)
+  {
+    fill = addToEvent(event, fill, "event: ", 7);
+    fill = addToEvent(event, fill, name, strlen(name));
+    fill = addToEvent(event, fill, "\n", 1);
+  }
+
+  // each line of data goes on a data line of its own; a CR would end
+  // the line for the client as well
+  do
+  {
+    const char *end = data;
+    while (*end != 0 && *end != '\r' && *end != '\n')
+      ++end;
+    fill = addToEvent(event, fill, "data: ", 6);
+    fill = addToEvent(event, fill, data, end - data);
+    fill = addToEvent(event, fill, "\n", 1);
+
+    data = end;
+    if (*data == '\r')
+      ++data;
+    if (*data == '\n')
+      ++data;
+  } while (*data != 0);
+
+  // an empty line ends the event
+  fill = addToEvent(event, fill, "\n", 1);
+  for (uint8_t i = 0; i < SIZE(m_streams); ++i)
+    streamWrite(m_streams[i], event, fill);
+}
+
+uint8_t WebServer::eventStreams()
+{
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < SIZE(m_streams); ++i)
+  {
+    if (m_streams[i].client)
+      ++count;
+  }
+  return count;
+}
+
+// Copy data to the end of an event being put together, sending what's
+// there to the streams each time the buffer fills.
+//
+// returns how much of the buffer is filled afterwards
+size_t WebServer::addToEvent(uint8_t *event, size_t fill,
+                             const char *data, size_t size)
+{
+  while (size > 0)
+  {
+    size_t count = WEBDUINO_EVENT_BLOCK_SIZE - fill;
+    if (count > size)
+      count = size;
+    memcpy(event + fill, data, count);
+    fill += count;
+    data += count;
+    size -= count;
+
+    if (fill == WEBDUINO_EVENT_BLOCK_SIZE)
+    {
+      for (uint8_t i = 0; i < SIZE(m_streams); ++i)
+        streamWrite(m_streams[i], event, fill);
+      fill = 0;
+    }
+  }
+  return fill;
+}
+
+// Send data on a stream, closing it if the client doesn't take it.
+void WebServer::streamWrite(EventStream &stream, const uint8_t *data,
+                            size_t size)
+{
+  if (!stream.client)
+    return;
+  if (stream.client.write(data, size) != size)
+    stream.client.stop();
+  stream.lastSent = millis();
+}
+
+// Look after the open event streams: close those whose client has gone
+// away, and send a comment line to those that have been quiet for a
+// while, which finds out about the others.
+void WebServer::serveEventStreams()
+{
+  for (uint8_t i = 0; i < SIZE(m_streams); ++i)
+  {
+    EventStream &stream = m_streams[i];
+    if (!stream.client)
+      continue;
+
+    // clients have nothing to say on a stream, so what comes is dropped
+    uint8_t discard[16];
+    while (stream.client.available() > 0 &&
+           stream.client.read(discard, sizeof(discard)) > 0)
+      ;
+
+    if (!stream.client.connected())
+      stream.client.stop();
+    else if (millis() - stream.lastSent >= WEBDUINO_EVENT_HEARTBEAT_IN_MS)
+      streamWrite(stream, (const uint8_t *)":\n", 2);
+  }
+}
+#endif
+
+#if WEBDUINO_WEBSOCKETS
+bool WebServer::startWebSocket(WebSocketCommand *cmd)
+{
+  uint8_t i = 0;
+  while (i < SIZE(m_webSockets) && m_webSockets[i].client)
+    ++i;
+  // the key is 16 bytes in Base64
+  const char *key = m_conn->arena + m_conn->webSocketKeyAt;
+  if (m_conn->requestType != GET || !m_conn->upgradeWebSocket ||
+      !m_conn->webSocketVersion || strlen(key) != 24 ||
+      i == SIZE(m_webSockets))
+    return false;
+
+  // the client's key with a GUID from RFC 6455 after it goes back
+  // hashed, to show the request was understood
+  P(webSocketGuid) = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  uint8_t input[24 + 36];
+  memcpy(input, key, 24);
+  memcpy_P(input + 24, webSocketGuid, 36);
+  uint8_t digest[20];
+  sha1(input, sizeof(input), digest);
+
+  P(base64Digits) =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char accept[29];
+  for (uint8_t in = 0, out = 0; in < 20; in += 3, out += 4)
+  {
+    uint32_t bits = (uint32_t)digest[in] << 16 | (uint16_t)digest[in + 1] << 8;
+    if (in + 2 < 20)
+      bits |= digest[in + 2];
+    for (uint8_t j = 0; j < 4; ++j)
+      accept[out + j] = pgm_read_byte(base64Digits + (bits >> (18 - 6 * j) & 63));
+  }
+  accept[27] = '=';
+  accept[28] = 0;
+
+  // the WebSocket only ends with the connection
+#if WEBDUINO_KEEP_ALIVE
+  m_conn->keepAlive = false;
+#endif
+  P(webSocketMsg1) =
+    "HTTP/1.1 101 Switching Protocols" CRLF;
+  printP(webSocketMsg1);
+#ifndef WEBDUINO_SUPRESS_SERVER_HEADER
+  printP(webServerHeader);
+#endif
+  P(webSocketMsg2) =
+    "Upgrade: websocket" CRLF
+    "Connection: Upgrade" CRLF
+    "Sec-WebSocket-Accept: ";
+  printP(webSocketMsg2);
+  print(accept);
+  printCRLF();
+  printCRLF();
+  flushBuf();
+
+  // the socket is the WebSocket's now, and is left alone when the
+  // handler is done
+  WebSocket &ws = m_webSockets[i];
+  ws.client = m_conn->client;
+  ws.cmd = cmd;
+  ws.lastSent = millis();
+  ws.frameState = FRAME_OPCODE;
+  ws.messageOpcode = 0;
+  ws.frameFill = 0;
+  ws.fill = 0;
+  m_conn->client = EthernetClient();
+  return true;
+}
+
+void WebServer::sendWebSocket(uint8_t client, const char *data,
+                              size_t length, bool binary)
+{
+  if (client < SIZE(m_webSockets))
+    sendFrame(m_webSockets[client], binary ? OPCODE_BINARY : OPCODE_TEXT,
+              (const uint8_t *)data, length);
+}
+
+void WebServer::sendWebSocket(const char *text)
+{
+  size_t length = strlen(text);
+  for (uint8_t i = 0; i < SIZE(m_webSockets); ++i)
+    sendFrame(m_webSockets[i], OPCODE_TEXT, (const uint8_t *)text, length);
+}
+
+void WebServer::closeWebSocket(uint8_t client, uint16_t status)
+{
+  if (client >= SIZE(m_webSockets))
+    return;
+
+  // the socket is let go of right away rather than after the client
+  // answers, as nothing it has left to say matters
+  WebSocket &ws = m_webSockets[client];
+  uint8_t payload[2] = { (uint8_t)(status >> 8), (uint8_t)status };
+  sendFrame(ws, OPCODE_CLOSE, payload, 2);
+  ws.client.stop();
+}
+
+uint8_t WebServer::webSockets()
+{
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < SIZE(m_webSockets); ++i)
+  {
+    if (m_webSockets[i].client)
+      ++count;
+  }
+  return count;
+}
+
+// Look after the open WebSockets: handle the frames that came in,
+// close those whose client has gone away, and ping those that have
+// been quiet for a while, which finds out about the others.
+void WebServer::serveWebSockets()
+{
+  for (uint8_t i = 0; i < SIZE(m_webSockets); ++i)
+  {
+    WebSocket &ws = m_webSockets[i];
+    if (!ws.client)
+      continue;
+
+    readFrames(i);
+
+    if (!ws.client)
+      continue;
+    if (!ws.client.connected())
+      ws.client.stop();
+    else if (millis() - ws.lastSent >= WEBDUINO_WEBSOCKET_PING_IN_MS)
+      sendFrame(ws, OPCODE_PING, (const uint8_t *)"", 0);
+  }
+}
+
+// Parse what has come in on a WebSocket so far, a byte at a time for
+// the frame headers and straight into the message buffer for the
+// payloads, handling each frame once all of it is in.
+void WebServer::readFrames(uint8_t client)
+{
+  WebSocket &ws = m_webSockets[client];
+  while (ws.client && ws.client.available() > 0)
+  {
+    if (ws.frameState == FRAME_PAYLOAD)
+    {
+      // the payload goes after the message so far.  Control frames only
+      // borrow the room there, so they can come between the frames of
+      // a message; there's always WEBDUINO_WEBSOCKET_CONTROL_SIZE of it
+      // for them.
+      char *at = ws.message + ws.fill + ws.frameFill;
+      int got = ws.client.read((uint8_t *)at, ws.left);
+      if (got <= 0)
+        return;
+      for (int j = 0; j < got; ++j)
+        at[j] ^= ws.mask[(ws.frameFill + j) & 3];
+      ws.frameFill += got;
+      ws.left -= got;
+      if (ws.left == 0)
+        endFrame(client);
+      continue;
+    }
+
+    int ch = ws.client.read();
+    if (ch < 0)
+      return;
+    switch (ws.frameState)
+    {
+    case FRAME_OPCODE:
+      ws.frameOpcode = ch;
+      ws.frameState = FRAME_LENGTH;
+      break;
+
+    case FRAME_LENGTH:
+    {
+      // no extensions were agreed on, clients must mask what they
+      // send, and control frames are short and can't be split, nor can
+      // they come in the middle of a message
+      uint8_t opcode = ws.frameOpcode & 0x0f;
+      bool valid;
+      if (opcode & 0x08)
+        valid = opcode <= OPCODE_PONG && (ws.frameOpcode & 0x80) &&
+                (ch & 0x7f) < 126;
+      else
+        valid = opcode <= OPCODE_BINARY &&
+                (opcode == OPCODE_CONTINUATION) == (ws.messageOpcode != 0);
+      if ((ws.frameOpcode & 0x70) != 0 || !(ch & 0x80) || !valid)
+      {
+        closeWebSocket(client, 1002);
+        return;
+      }
+      ch &= 0x7f;
+      ws.left = (ch < 126) ? ch : 0;
+      ws.count = (ch == 126) ? 2 : (ch == 127) ? 8 : 0;
+      if (ws.count == 0)
+      {
+        ws.count = 4;
+        ws.frameState = FRAME_MASK;
+      }
+      else
+        ws.frameState = FRAME_EXTENDED_LENGTH;
+      break;
+    }
+
+    case FRAME_EXTENDED_LENGTH:
+      // lengths that don't fit in 32 bits are too big anyway
+      ws.left = (ws.left > 0xffffff) ? 0xffffffff : (ws.left << 8 | ch);
+      if (--ws.count == 0)
+      {
+        ws.count = 4;
+        ws.frameState = FRAME_MASK;
+      }
+      break;
+
+    case FRAME_MASK:
+      ws.mask[4 - ws.count] = ch;
+      if (--ws.count > 0)
+        break;
+      ws.frameFill = 0;
+      if (ws.left > ((ws.frameOpcode & 0x08) ?
+                     WEBDUINO_WEBSOCKET_CONTROL_SIZE :
+                     (uint16_t)(WEBDUINO_WEBSOCKET_MESSAGE_SIZE - ws.fill)))
+      {
+        closeWebSocket(client, 1009);
+        return;
+      }
+      ws.frameState = FRAME_PAYLOAD;
+      if (ws.left == 0)
+        endFrame(client);
+      break;
+    }
+  }
+}
+
+// Act on a frame that is all in: answer pings and closes, and pass
+// complete messages to the WebSocket's handler.
+void WebServer::endFrame(uint8_t client)
+{
+  WebSocket &ws = m_webSockets[client];
+  uint8_t opcode = ws.frameOpcode & 0x0f;
+  const uint8_t *payload = (const uint8_t *)ws.message + ws.fill;
+  uint16_t length = ws.frameFill;
+  ws.frameState = FRAME_OPCODE;
+  ws.frameFill = 0;
+
+  if (opcode == OPCODE_CLOSE)
+  {
+    // answer with the status code the client closed with
+    sendFrame(ws, OPCODE_CLOSE, payload, length < 2 ? length : 2);
+    ws.client.stop();
+  }
+  else if (opcode == OPCODE_PING)
+    sendFrame(ws, OPCODE_PONG, payload, length);
+  else if (opcode != OPCODE_PONG)
+  {
+    if (opcode != OPCODE_CONTINUATION)
+      ws.messageOpcode = opcode;
+    ws.fill += length;
+    if (ws.frameOpcode & 0x80)
+    {
+      // the handler may send, or close the WebSocket, so the next
+      // message is started on first
+      bool binary = ws.messageOpcode == OPCODE_BINARY;
+      length = ws.fill;
+      ws.message[length] = 0;
+      ws.messageOpcode = 0;
+      ws.fill = 0;
+      ws.cmd(*this, client, ws.message, length, binary);
+    }
+  }
+}
+
+// Send a frame on a WebSocket, closing it if the client doesn't take
+// it.  The header and as much of the payload as fits go out together.
+void WebServer::sendFrame(WebSocket &ws, uint8_t opcode,
+                          const uint8_t *payload, size_t length)
+{
+  if (!ws.client)
+    return;
+
+  uint8_t frame[WEBDUINO_WEBSOCKET_BLOCK_SIZE];
+  size_t fill;
+  frame[0] = 0x80 | opcode;
+  if (length < 126)
+  {
+    frame[1] = length;
+    fill = 2;
+  }
+  else if (length <= 0xffff)
+  {
+    frame[1] = 126;
+    frame[2] = length >> 8;
+    frame[3] = length;
+    fill = 4;
+  }
+  else
+  {
+    frame[1] = 127;
+    for (uint8_t j = 0; j < 8; ++j)
+      frame[2 + j] = (j < 4) ? 0 : (uint32_t)length >> (8 * (7 - j));
+    fill = 10;
+  }
+
+  size_t count = sizeof(frame) - fill;
+  if (count > length)
+    count = length;
+  memcpy(frame + fill, payload, count);
+  fill += count;
+  bool sent = ws.client.write(frame, fill) == fill;
+  if (sent && count < length)
+    sent = ws.client.write(payload + count, length - count) == length - count;
+  if (!sent)
+    ws.client.stop();
+  ws.lastSent = millis();
+}
+
+// Put the 20 byte SHA-1 hash of data in digest, for the handshake.
+void WebServer::sha1(const uint8_t *data, size_t length, uint8_t *digest)
+{
+  uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe,
+                        0x10325476, 0xc3d2e1f0 };
+
+  // the data is followed by a 1 bit, 0 bits up to the end of a 64 byte
+  // block but for 8 bytes, and its length in bits in those
+  size_t total = ((length + 8) / 64 + 1) * 64;
+  uint8_t block[64];
+  for (size_t offset = 0; offset < total; offset += 64)
+  {
+    for (uint8_t j = 0; j < 64; ++j)
+    {
+      size_t n = offset + j;
+      if (n < length)
+        block[j] = data[n];
+      else if (n == length)
+        block[j] = 0x80;
+      else if (n >= total - 4)
+        block[j] = (uint32_t)length << 3 >> (8 * (total - 1 - n));
+      else
+        block[j] = 0;
+    }
+    sha1Block(state, block);
+  }
+
+  for (uint8_t j = 0; j < 20; ++j)
+    digest[j] = state[j / 4] >> (24 - 8 * (j % 4));
+}
+
+// Mix a 64 byte block into the state of a SHA-1 hash.  The message
+// schedule is kept to the last 16 words.
+void WebServer::sha1Block(uint32_t *state, const uint8_t *block)
+{
+  uint32_t w[16];
+  for (uint8_t j = 0; j < 16; ++j)
+    w[j] = (uint32_t)block[4 * j] << 24 | (uint32_t)block[4 * j + 1] << 16 |
+           (uint32_t)block[4 * j + 2] << 8 | block[4 * j + 3];
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (uint8_t j = 0; j < 80; ++j)
+  {
+    if (j >= 16)
+    {
+      uint32_t t = w[(j + 13) & 15] ^ w[(j + 8) & 15] ^ w[(j + 2) & 15] ^
+                   w[j & 15];
+      w[j & 15] = t << 1 | t >> 31;
+    }
+
+    uint32_t f, k;
+    if (j < 20)
+    {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    }
+    else if (j < 40)
+    {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    }
+    else if (j < 60)
+    {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    }
+    else
+    {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+
+    uint32_t t = (a << 5 | a >> 27) + f + e + k + w[j & 15];
+    e = d;
+    d = c;
+    c = b << 30 | b >> 2;
+    b = a;
+    a = t;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+#endif
+
+int WebServer::read()
+{
+  if (!m_conn->client)
+    return -1;
+
+  if (m_pushbackDepth == 0)
+  {
+    unsigned long timeoutTime = millis() + WEBDUINO_READ_TIMEOUT_IN_MS;
+
+    while (inputCount() > 0 || m_conn->client.connected())
+    {
+      // stop reading the socket early if we get to content-length
+      // characters in the POST.  This is because some clients leave
+      // the socket open because they assume HTTP keep-alive.
+      if (m_conn->readingContent)
+      {
+        if (m_conn->contentLength == 0)
+        {
+#if WEBDUINO_SERIAL_DEBUGGING > 1
+          Serial.println("\n*** End of content, terminating connection");
+#endif
+          return -1;
+        }
+      }
+
+      int ch = readInput();
+
+      // if we get a character, return it, otherwise continue in while
+      // loop, checking connection status
+      if (ch != -1)
+      {
+        // count character against content-length
+        if (m_conn->readingContent)
+        {
+          --m_conn->contentLength;
+        }
+
+#if WEBDUINO_SERIAL_DEBUGGING
+        if (ch == '\r')
+          Serial.print("<CR>");
+        else if (ch == '\n')
+          Serial.println("<LF>");
+        else
+          Serial.print((char)ch);
+#endif
+        return ch;
+      }
+      else
+      {
+        unsigned long now = millis();
+        if (now > timeoutTime)
+        {
+          // connection timed out, destroy client, return EOF
+#if WEBDUINO_SERIAL_DEBUGGING
+          Serial.println("*** Connection timed out");
+#endif
+#if WEBDUINO_METRICS
+          ++m_timeouts;
+#endif
+          reset();
+          return -1;
+        }
+      }
+    }
+
+    // connection lost, return EOF
+#if WEBDUINO_SERIAL_DEBUGGING
+    Serial.println("*** Connection lost");
+#endif
+    return -1;
+  }
+  else
+    return m_pushback[--m_pushbackDepth];
+}
+
+// Return the next character that has arrived from the client, or -1
+// if there's none yet.  The input buffer is refilled with a single
+// block read once it's empty, so the characters just consumed stay in
+// it and push() can usually step back over them.
+int WebServer::readInput()
+{
+#if WEBDUINO_INPUT_BUFFER_SIZE
+  if (m_conn->inCount == 0)
+  {
+    int got = m_conn->client.read(m_conn->input, sizeof(m_conn->input));
+    if (got <= 0)
+      return -1;
+    m_conn->inHead = 0;
+    m_conn->inCount = got;
+#if WEBDUINO_METRICS
+    m_conn->bytesIn += got;
+#endif
+  }
+  --m_conn->inCount;
+  return m_conn->input[m_conn->inHead++];
+#else
+  int ch = m_conn->client.read();
+#if WEBDUINO_METRICS
+  if (ch != -1)
+    ++m_conn->bytesIn;
+#endif
+  return ch;
+#endif
+}
+
+size_t WebServer::readBytes(uint8_t *buffer, size_t length)
+{
+  size_t count = 0;
+
+  // characters that were pushed back come first
+  while (count < length && m_pushbackDepth > 0)
+    buffer[count++] = m_pushback[--m_pushbackDepth];
+
+  unsigned long timeoutTime = millis() + WEBDUINO_READ_TIMEOUT_IN_MS;
+
+  while (count < length && m_conn->client)
+  {
+    size_t wanted = length - count;
+    if (m_conn->readingContent)
+    {
+      if (m_conn->contentLength <= 0)
+        break;
+      if ((long)wanted > m_conn->contentLength)
+        wanted = m_conn->contentLength;
+    }
+
+    int got;
+#if WEBDUINO_INPUT_BUFFER_SIZE
+    if (m_conn->inCount > 0)
+    {
+      got = (wanted < m_conn->inCount) ? wanted : m_conn->inCount;
+      memcpy(buffer + count, m_conn->input + m_conn->inHead, got);
+      m_conn->inHead += got;
+      m_conn->inCount -= got;
+    }
+    else
+#endif
+    {
+      // nothing is buffered, so read straight into the caller's buffer
+      got = m_conn->client.read(buffer + count, wanted);
+#if WEBDUINO_METRICS
+      if (got > 0)
+        m_conn->bytesIn += got;
+#endif
+    }
+
+    if (got > 0)
+    {
+      count += got;
+      if (m_conn->readingContent)
+        m_conn->contentLength -= got;
+      timeoutTime = millis() + WEBDUINO_READ_TIMEOUT_IN_MS;
+    }
+    else if (!m_conn->client.connected())
+    {
+      break;
+    }
+    else if (millis() > timeoutTime)
+    {
+#if WEBDUINO_SERIAL_DEBUGGING
+      Serial.println("*** Connection timed out");
+#endif
+#if WEBDUINO_METRICS
+      ++m_timeouts;
+#endif
+      reset();
+      break;
+    }
+  }
+  return count;
+}
+
+void WebServer::push(int ch)
+{
+  // don't allow pushing EOF
+  if (ch == -1)
+    return;
+
+#if WEBDUINO_INPUT_BUFFER_SIZE
+  // step back over the character if it's still in the input buffer
+  if (m_pushbackDepth == 0 && m_conn->inHead > 0 &&
+      m_conn->input[m_conn->inHead - 1] == (uint8_t)ch)
+  {
+    --m_conn->inHead;
+    ++m_conn->inCount;
+    // it will be counted against content-length again
+    if (m_conn->readingContent)
+      ++m_conn->contentLength;
+    return;
+  }
+#endif
+
+  m_pushback[m_pushbackDepth++] = ch;
+  // can't raise error here, so just replace last char over and over
+  if (m_pushbackDepth == SIZE(m_pushback))
+    m_pushbackDepth = SIZE(m_pushback) - 1;
+}
+
+void WebServer::reset()
+{
+  m_pushbackDepth = 0;
+#if WEBDUINO_INPUT_BUFFER_SIZE
+  m_conn->inHead = 0;
+  m_conn->inCount = 0;
+#endif
+  m_conn->client.flush();
+  m_conn->client.stop();
+  clearArena();
+}
+
+bool WebServer::expect(const char *str)
+{
+  const char *curr = str;
+  while (*curr != 0)
+  {
+    int ch = read();
+    if (ch != *curr++)
+    {
+      // push back ch and the characters we accepted
+      push(ch);
+      while (--curr != str)
+        push(curr[-1]);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool WebServer::readInt(int &number)
+{
+  bool negate = false;
+  bool gotNumber = false;
+  int ch;
+  number = 0;
+
+  // absorb whitespace
+  do
+  {
+    ch = read();
+  } while (ch == ' ' || ch == '\t');
+
+  // check for leading minus sign
+  if (ch == '-')
+  {
+    negate = true;
+    ch = read();
+  }
+
+  // read digits to update number, exit when we find non-digit
+  while (ch >= '0' && ch <= '9')
+  {
+    gotNumber = true;
+    number = number * 10 + ch - '0';
+    ch = read();
+  }
+
+  push(ch);
+  if (negate)
+    number = -number;
+  return gotNumber;
+}
+
+void WebServer::readHeader(char *value, int valueLen)
+{
+  int ch;
+  memset(value, 0, valueLen);
+  --valueLen;
+
+  // absorb whitespace
+  do
+  {
+    ch = read();
+  } while (ch == ' ' || ch == '\t');
+
+  // read rest of line
+  do
+  {
+    if (valueLen > 1)
+    {
+      *value++=ch;
+      --valueLen;
+    }
+    ch = read();
+  } while (ch != '\r');
+  push(ch);
+}
+
+bool WebServer::readPOSTparam(char *name, int nameLen,
+                              char *value, int valueLen)
+{
+  // assume name is at current place in stream
+  int ch;
+  // to not to miss the last parameter
+  bool foundSomething = false;
+
+  // clear out name and value so they'll be NUL terminated
+  memset(name, 0, nameLen);
+  memset(value, 0, valueLen);
+
+  // decrement length so we don't write into NUL terminator
+  --nameLen;
+  --valueLen;
+
+  while ((ch = read()) != -1)
+  {
+    foundSomething = true;
+    if (ch == '+')
+    {
+      ch = ' ';
+    }
+    else if (ch == '=')
+    {
+      /* that's end of name, so switch to storing in value */
+      nameLen = 0;
+      continue;
+    }
+    else if (ch == '&')
+    {
+      /* that's end of pair, go away */
+      return true;
+    }
+    else if (ch == '%')
+    {
+      /* handle URL encoded characters by converting back to original form */
+      int ch1 = read();
+      int ch2 = read();
+      if (ch1 == -1 || ch2 == -1)
+        return false;
+      char hex[3] = { (char)ch1, (char)ch2, '\0' };
+      ch = strtoul(hex, NULL, 16);
+    }
+
+    // output the new character into the appropriate buffer or drop it if
+    // there's no room in either one.  This code will malfunction in the
+    // case where the parameter name is too long to fit into the name buffer,
+    // but in that case, it will just overflow into the value buffer so
+    // there's no harm.
+    if (nameLen > 0)
+    {
+      *name++ = ch;
+      --nameLen;
+    }
+    else if (valueLen > 0)
+    {
+      *value++ = ch;
+      --valueLen;
+    }
+  }
+
+  if (foundSomething)
+  {
+    // if we get here, we have one last parameter to serve
+    return true;
+  }
+  else
+  {
+    // if we get here, we hit the end-of-file, so POST is over and there
+    // are no more parameters
+    return false;
+  }
+}
+
+#if WEBDUINO_MULTIPART
+bool WebServer::readMultipart(MultipartCommand *cmd)
+{
+  // the parts are separated by "\r\n--" and the boundary, which also
+  // starts the body without the line break, and the last one is
+  // followed by "--"
+  uint8_t delimLen = 4 + m_conn->boundaryLen;
+  if (m_conn->boundaryLen == 0)
+    return false;
+
+  enum { PREAMBLE, AFTER_DELIMITER, HEADERS, DATA } state = PREAMBLE;
+  uint8_t matched = 2;  // how much of the delimiter was found
+  uint8_t held = 0;     // how much of that came in earlier blocks
+  uint8_t dashes = 0;
+  char line[WEBDUINO_MULTIPART_HEADER_LENGTH];
+  uint8_t lineLen = 0;
+  uint8_t block[WEBDUINO_MULTIPART_BLOCK_SIZE];
+  size_t got;
+
+  while ((got = readBytes(block, sizeof(block))) > 0)
+  {
+    // the data of this block not handed over yet starts here
+    size_t start = 0;
+    held = matched;
+    for (size_t i = 0; i < got; ++i)
+    {
+      uint8_t ch = block[i];
+      switch (state)
+      {
+      case PREAMBLE:
+      case DATA:
+      {
+        char expected = (matched < 4) ? "\r\n--"[matched]
+                                      : m_conn->boundary[matched - 4];
+        if (ch == expected)
+        {
+          if (++matched < delimLen)
+            break;
+          // the part's data stops where the delimiter started
+          if (state == DATA)
+          {
+            if (i + 1 - start > (size_t)(delimLen - held))
+              cmd(*this, MULTIPART_DATA, (const char *)block + start,
+                  i + 1 - start - (delimLen - held));
+            cmd(*this, MULTIPART_END, NULL, 0);
+          }
+          state = AFTER_DELIMITER;
+          dashes = 0;
+          break;
+        }
+        // no delimiter after all: what was taken for the beginning of
+        // one is data.  As "\r" only comes up at its start, the search
+        // starts over from this character.
+        if (held > 0 && state == DATA)
+        {
+          cmd(*this, MULTIPART_DATA, "\r\n--", (held < 4) ? held : 4);
+          if (held > 4)
+            cmd(*this, MULTIPART_DATA, m_conn->boundary, held - 4);
+        }
+        held = 0;
+        matched = (ch == '\r') ? 1 : 0;
+        break;
+      }
+
+      case AFTER_DELIMITER:
+        // "--" ends the body; anything else up to the end of the
+        // line is padding before the headers of the next part
+        if (ch == '-' && ++dashes == 2)
+          return true;
+        if (ch == '\n')
+        {
+          state = HEADERS;
+          lineLen = 0;
+        }
+        break;
+
+      case HEADERS:
+        if (ch == '\r')
+          break;
+        if (ch != '\n')
+        {
+          if (lineLen < sizeof(line) - 1)
+            line[lineLen++] = ch;
+          break;
+        }
+        // an empty line ends the headers
+        if (lineLen == 0)
+        {
+          state = DATA;
+          matched = 0;
+          held = 0;
+          start = i + 1;
+          break;
+        }
+        line[lineLen] = 0;
+        cmd(*this, MULTIPART_HEADER, line, lineLen);
+        lineLen = 0;
+        break;
+      }
+    }
+
+    // hand over the data of the block, but for what may turn out to be
+    // the beginning of a delimiter
+    if (state == DATA && got - start > (size_t)(matched - held))
+      cmd(*this, MULTIPART_DATA, (const char *)block + start,
+          got - start - (matched - held));
+  }
+  return false;
+}
+#endif
+
+bool WebServer::readJson(JsonCommand *cmd)
+{
+  enum { VALUE, KEY_OR_END, KEY, COLON, COMMA_OR_END,
+         STRING, ESCAPE, UNICODE, LITERAL };
+  uint8_t state = VALUE;
+  // how far a number has come, checked as it comes in as it may not
+  // all fit in value: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+  enum { NUM_START, NUM_SIGN, NUM_ZERO, NUM_INTEGER, NUM_POINT,
+         NUM_FRACTION, NUM_E, NUM_E_SIGN, NUM_EXPONENT, NUM_BAD };
+  uint8_t number = NUM_START;
+  uint16_t unicode = 0; // the \u escape being read
+  uint8_t digits = 0;
+  uint16_t high = 0;    // the first half of a surrogate pair, if any
+
+  // the path of the current value, and where it ends for each level
+  // of nesting
+  char path[WEBDUINO_JSON_PATH_LENGTH];
+  uint8_t pathLen = 0;
+  uint8_t depth = 0;
+  uint8_t pathStart[WEBDUINO_JSON_DEPTH + 1];
+  uint16_t index[WEBDUINO_JSON_DEPTH + 1];
+  uint32_t arrays = 0;  // one bit for each level, set for arrays
+  pathStart[0] = 0;
+
+  char value[WEBDUINO_JSON_VALUE_LENGTH];
+  uint8_t valueLen = 0;
+
+  // where the string being read goes: a key to the path, a value to
+  // value
+  char *text = value;
+  uint8_t *textLen = &valueLen;
+  uint8_t textSize = sizeof(value);
+
+  uint8_t block[WEBDUINO_JSON_BLOCK_SIZE];
+  size_t got = 0, i = 0;
+  while (1)
+  {
+    if (i == got)
+    {
+      got = readBytes(block, sizeof(block));
+      i = 0;
+    }
+    // the end of the body only ends a number or literal at the top
+    int ch = (got > 0) ? block[i] : -1;
+    if (ch == -1 && state != LITERAL)
+      return false;
+
+    bool array = (arrays >> depth) & 1;
+    bool space = (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+    switch (state)
+    {
+    case VALUE:
+      if (space)
+        break;
+      if (array)
+      {
+        if (ch == ']' && index[depth] == 0)
+        {
+          if (--depth == 0)
+            return true;
+          state = COMMA_OR_END;
+          break;
+        }
+        // the path of an array element ends in its index
+        char number[5];
+        char *end = number + sizeof(number);
+        char *start = formatDecimal(end, index[depth]);
+        pathLen = pathStart[depth];
+        addJsonChar(path, sizeof(path), pathLen, '[');
+        while (start < end)
+          addJsonChar(path, sizeof(path), pathLen, *start++);
+        addJsonChar(path, sizeof(path), pathLen, ']');
+      }
+      if (ch == '{' || ch == '[')
+      {
+        if (depth == WEBDUINO_JSON_DEPTH || depth == 31)
+          return false;
+        ++depth;
+        if (ch == '[')
+          arrays |= 1UL << depth;
+        else
+          arrays &= ~(1UL << depth);
+        pathStart[depth] = pathLen;
+        index[depth] = 0;
+        state = (ch == '[') ? VALUE : KEY_OR_END;
+        break;
+      }
+      valueLen = 0;
+      number = NUM_START;
+      if (ch == '"')
+      {
+        text = value;
+        textLen = &valueLen;
+        textSize = sizeof(value);
+        state = STRING;
+        break;
+      }
+      // look at the character again as part of the literal
+      state = LITERAL;
+      continue;
+
+    case KEY_OR_END:
+    case KEY:
+      if (space)
+        break;
+      // a comma has to be followed by another member
+      if (ch == '}' && state == KEY_OR_END)
+      {
+        if (--depth == 0)
+          return true;
+        state = COMMA_OR_END;
+        break;
+      }
+      if (ch != '"')
+        return false;
+      // the path of an object member ends in its name
+      pathLen = pathStart[depth];
+      if (pathLen > 0)
+        addJsonChar(path, sizeof(path), pathLen, '.');
+      text = path;
+      textLen = &pathLen;
+      textSize = sizeof(path);
+      state = STRING;
+      break;
+
+    case COLON:
+      if (ch == ':')
+        state = VALUE;
+      else if (!space)
+        return false;
+      break;
+
+    case COMMA_OR_END:
+      if (space)
+        break;
+      if (ch == ',')
+      {
+        if (array)
+          ++index[depth];
+        state = array ? VALUE : KEY;
+        break;
+      }
+      if (ch != (array ? ']' : '}'))
+        return false;
+      if (--depth == 0)
+        return true;
+      break;
+
+    case STRING:
+      // the first half of a surrogate pair has to be followed by the
+      // second; on its own it's no character
+      if (high != 0 && ch != '\\')
+      {
+        addJsonUTF8(text, textSize, *textLen, 0xfffd);
+        high = 0;
+      }
+      if (ch == '\\')
+      {
+        state = ESCAPE;
+        break;
+      }
+      if (ch < ' ')
+        return false;
+      if (ch != '"')
+      {
+        addJsonChar(text, textSize, *textLen, ch);
+        break;
+      }
+      if (text == path)
+      {
+        state = COLON;
+        break;
+      }
+      value[(valueLen < sizeof(value)) ? valueLen : sizeof(value) - 1] = 0;
+      if (pathLen < sizeof(path))
+      {
+        path[pathLen] = 0;
+        cmd(*this, path, JSON_STRING, value);
+      }
+      if (depth == 0)
+        return true;
+      state = COMMA_OR_END;
+      break;
+
+    case ESCAPE:
+      if (high != 0 && ch != 'u')
+      {
+        addJsonUTF8(text, textSize, *textLen, 0xfffd);
+        high = 0;
+      }
+      state = STRING;
+      switch (ch)
+      {
+      case 'b': ch = '\b'; break;
+      case 'f': ch = '\f'; break;
+      case 'n': ch = '\n'; break;
+      case 'r': ch = '\r'; break;
+      case 't': ch = '\t'; break;
+      case '"':
+      case '\\':
+      case '/':
+        break;
+      case 'u':
+        state = UNICODE;
+        unicode = 0;
+        digits = 0;
+        break;
+      default:
+        return false;
+      }
+      if (state == STRING)
+        addJsonChar(text, textSize, *textLen, ch);
+      break;
+
+    case UNICODE:
+      unicode <<= 4;
+      if (ch >= '0' && ch <= '9')
+        unicode |= ch - '0';
+      else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+        unicode |= (ch | 0x20) - 'a' + 10;
+      else
+        return false;
+      if (++digits < 4)
+        break;
+      // characters beyond the first 65536 come as a surrogate pair, two
+      // escapes that are put back together here; halves that aren't
+      // part of a pair become U+FFFD
+      state = STRING;
+      if (high != 0 && unicode >= 0xdc00 && unicode < 0xe000)
+      {
+        addJsonUTF8(text, textSize, *textLen,
+                    0x10000 + ((uint32_t)(high - 0xd800) << 10) +
+                    (unicode - 0xdc00));
+        high = 0;
+        break;
+      }
+      if (high != 0)
+      {
+        addJsonUTF8(text, textSize, *textLen, 0xfffd);
+        high = 0;
+      }
+      if (unicode >= 0xd800 && unicode < 0xdc00)
+        high = unicode;
+      else if (unicode >= 0xdc00 && unicode < 0xe000)
+        addJsonUTF8(text, textSize, *textLen, 0xfffd);
+      else
+        addJsonUTF8(text, textSize, *textLen, unicode);
+      break;
+
+    case LITERAL:
+      // a number, true, false or null runs up to whatever can't be
+      // part of one, which is then looked at again
+      if ((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') ||
+          ch == '-' || ch == '+' || ch == '.' || ch == 'E')
+      {
+        bool digit = (ch >= '0' && ch <= '9');
+        bool e = ((ch | 0x20) == 'e');
+        switch (number)
+        {
+        case NUM_START:
+        case NUM_SIGN:
+          number = (ch == '0') ? NUM_ZERO : digit ? NUM_INTEGER :
+                   (ch == '-' && number == NUM_START) ? NUM_SIGN : NUM_BAD;
+          break;
+        case NUM_ZERO:
+        case NUM_INTEGER:
+          number = (digit && number == NUM_INTEGER) ? NUM_INTEGER :
+                   (ch == '.') ? NUM_POINT : e ? NUM_E : NUM_BAD;
+          break;
+        case NUM_POINT:
+        case NUM_FRACTION:
+          number = digit ? NUM_FRACTION :
+                   (e && number == NUM_FRACTION) ? NUM_E : NUM_BAD;
+          break;
+        case NUM_E:
+        case NUM_E_SIGN:
+        case NUM_EXPONENT:
+          number = digit ? NUM_EXPONENT :
+                   ((ch == '+' || ch == '-') && number == NUM_E) ? NUM_E_SIGN :
+                   NUM_BAD;
+          break;
+        }
+        addJsonChar(value, sizeof(value), valueLen, ch);
+        break;
+      }
+      value[(valueLen < sizeof(value)) ? valueLen : sizeof(value) - 1] = 0;
+      JsonType type;
+      if (value[0] == '-' || (value[0] >= '0' && value[0] <= '9'))
+      {
+        if (number != NUM_ZERO && number != NUM_INTEGER &&
+            number != NUM_FRACTION && number != NUM_EXPONENT)
+          return false;
+        type = JSON_NUMBER;
+      }
+      else if (strcmp(value, "true") == 0 || strcmp(value, "false") == 0)
+        type = JSON_BOOLEAN;
+      else if (strcmp(value, "null") == 0)
+        type = JSON_NULL;
+      else
+        return false;
+      if (pathLen < sizeof(path))
+      {
+        path[pathLen] = 0;
+        cmd(*this, path, type, value);
+      }
+      if (depth == 0)
+        return true;
+      state = COMMA_OR_END;
+      continue;
     }
+    ++i;
   }
-  return true;
 }
 
-bool WebServer::readInt(int &number)
+// Add a character to a path or value read by readJson.  Its length
+// goes on counting past the end of the buffer, up to 255, so too long
+// paths can be told apart.
+void WebServer::addJsonChar(char *buffer, uint8_t size, uint8_t &length,
+                            char ch)
 {
-  bool negate = false;
-  bool gotNumber = false;
-  int ch;
-  number = 0;
-
-  // absorb whitespace
-  do
-  {
-    ch = read();
-  } while (ch == ' ' || ch == '\t');
-
-  // check for leading minus sign
-  if (ch == '-')
-  {
-    negate = true;
-    ch = read();
-  }
-
-  // read digits to update number, exit when we find non-digit
-  while (ch >= '0' && ch <= '9')
-  {
-    gotNumber = true;
-    number = number * 10 + ch - '0';
-    ch = read();
-  }
-
-  push(ch);
-  if (negate)
-    number = -number;
-  return gotNumber;
+  if (length < size)
+    buffer[length] = ch;
+  if (length < 255)
+    ++length;
 }
 
-void WebServer::readHeader(char *value, int valueLen)
+// Add a character given by its code to a path or value read by
+// readJson, as UTF-8.
+void WebServer::addJsonUTF8(char *buffer, uint8_t size, uint8_t &length,
+                            uint32_t code)
 {
-  int ch;
-  memset(value, 0, valueLen);
-  --valueLen;
-
-  // absorb whitespace
-  do
+  if (code < 0x80)
   {
-    ch = read();
-  } while (ch == ' ' || ch == '\t');
-
-  // read rest of line
-  do
+    addJsonChar(buffer, size, length, code);
+    return;
+  }
+  if (code < 0x800)
+    addJsonChar(buffer, size, length, 0xc0 | (code >> 6));
+  else
   {
-    if (valueLen > 1)
+    if (code < 0x10000)
+      addJsonChar(buffer, size, length, 0xe0 | (code >> 12));
+    else
     {
-      *value++=ch;
-      --valueLen;
+      addJsonChar(buffer, size, length, 0xf0 | (code >> 18));
+      addJsonChar(buffer, size, length, 0x80 | ((code >> 12) & 0x3f));
     }
-    ch = read();
-  } while (ch != '\r');
-  push(ch);
+    addJsonChar(buffer, size, length, 0x80 | ((code >> 6) & 0x3f));
+  }
+  addJsonChar(buffer, size, length, 0x80 | (code & 0x3f));
 }
 
-bool WebServer::readPOSTparam(char *name, int nameLen,
-                              char *value, int valueLen)
+bool WebServer::headerParam(const char *header, const char *param,
+                            char *value, int valueLen)
 {
-  // assume name is at current place in stream
-  int ch;
-  // to not to miss the last parameter
-  bool foundSomething = false;
-
-  // clear out name and value so they'll be NUL terminated
-  memset(name, 0, nameLen);
-  memset(value, 0, valueLen);
-
-  // decrement length so we don't write into NUL terminator
-  --nameLen;
-  --valueLen;
-
-  while ((ch = read()) != -1)
+  size_t len = strlen(param);
+  while ((header = strchr(header, ';')) != NULL)
   {
-    foundSomething = true;
-    if (ch == '+')
-    {
-      ch = ' ';
-    }
-    else if (ch == '=')
-    {
-      /* that's end of name, so switch to storing in value */
-      nameLen = 0;
+    ++header;
+    while (*header == ' ')
+      ++header;
+    if (strncasecmp(header, param, len) != 0 || header[len] != '=')
       continue;
-    }
-    else if (ch == '&')
-    {
-      /* that's end of pair, go away */
-      return true;
-    }
-    else if (ch == '%')
-    {
-      /* handle URL encoded characters by converting back to original form */
-      int ch1 = read();
-      int ch2 = read();
-      if (ch1 == -1 || ch2 == -1)
-        return false;
-      char hex[3] = { (char)ch1, (char)ch2, '\0' };
-      ch = strtoul(hex, NULL, 16);
-    }
 
-    // output the new character into the appropriate buffer or drop it if
-    // there's no room in either one.  This code will malfunction in the
-    // case where the parameter name is too long to fit into the name buffer,
-    // but in that case, it will just overflow into the value buffer so
-    // there's no harm.
-    if (nameLen > 0)
-    {
-      *name++ = ch;
-      --nameLen;
-    }
-    else if (valueLen > 0)
+    header += len + 1;
+    bool quoted = (*header == '"');
+    if (quoted)
+      ++header;
+    int i = 0;
+    for (; *header && (quoted ? *header != '"' : *header != ';'); ++header)
     {
-      *value++ = ch;
-      --valueLen;
+      if (i < valueLen - 1)
+        value[i++] = *header;
     }
-  }
-
-  if (foundSomething)
-  {
-    // if we get here, we have one last parameter to serve
+    value[i] = 0;
     return true;
   }
-  else
-  {
-    // if we get here, we hit the end-of-file, so POST is over and there
-    // are no more parameters
-    return false;
-  }
+  return false;
 }
 
 /* Retrieve a parameter that was encoded as part of the URL, stored in
@@ -1165,112 +5065,936 @@ URLPARAM_RESULT WebServer::nextURLparam(char **tail, char *name, int nameLen,
   return result;
 }
 
-
-
-// Read and parse the first line of the request header.
-// The "command" (GET/HEAD/POST) is translated into a numeric value in type.
-// The URL is stored in request,  up to the length passed in length
-// NOTE 1: length must include one byte for the terminating NUL.
-// NOTE 2: request is NOT checked for NULL,  nor length for a value < 1.
-// Reading stops when the code encounters a space, CR, or LF.  If the HTTP
-// version was supplied by the client,  it will still be waiting in the input
-// stream when we exit.
+// Decode the character of a URL at s, which may be a %xx escape or a +
+// for a space, and step past it.  A % without two hex digits after it
+// is left as it is.
+char WebServer::decodeURLchar(char *&s)
+{
+  char ch = *s++;
+  if (ch == '+')
+    return ' ';
+  if (ch != '%')
+    return ch;
+
+  int8_t high = hexValue(s[0]);
+  int8_t low = (high < 0) ? -1 : hexValue(s[1]);
+  if (low < 0)
+    return ch;
+  s += 2;
+  return high * 16 + low;
+}
+
+// the value of a hex digit, or -1 if ch isn't one
+int8_t WebServer::hexValue(char ch)
+{
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+  ch |= 0x20;
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+  return -1;
+}
+
+// Decode a name or value of a URL in place, from s up to stop, the
+// next '&' or the end, and leave s there.  The decoded text is never
+// longer, so it fits where it was.
+//
+// returns its length
+size_t WebServer::decodeURL(char *&s, char stop)
+{
+  char *out = s;
+  char *start = s;
+  while (*s != 0 && *s != '&' && *s != stop)
+    *out++ = decodeURLchar(s);
+  return out - start;
+}
+
+bool WebServer::nextURLparam(char **tail, URLParam &param)
+{
+  char *s = *tail;
+  if (*s == 0)
+    return false;
+
+  // the '=' and '&' are read before the NULs go over them
+  param.name = s;
+  param.nameLength = decodeURL(s, '=');
+  char stop = *s;
+  param.name[param.nameLength] = 0;
+  if (stop == '=')
+  {
+    param.value = ++s;
+    param.valueLength = decodeURL(s, '&');
+    stop = *s;
+    param.value[param.valueLength] = 0;
+  }
+  else
+  {
+    // a parameter without '=' has an empty value
+    param.value = param.name + param.nameLength;
+    param.valueLength = 0;
+  }
+
+  *tail = (stop == 0) ? s : s + 1;
+  return true;
+}
+
+char *WebServer::findParam(char *tail, const char *name, size_t *length)
+{
+  char *s = tail;
+  while (*s != 0)
+  {
+    // compare the name as it's decoded, without changing it
+    const char *wanted = name;
+    bool match = true;
+    while (*s != 0 && *s != '&' && *s != '=')
+    {
+      char ch = decodeURLchar(s);
+      if (*wanted == ch)
+        ++wanted;
+      else
+        match = false;
+    }
+    match = match && *wanted == 0;
+
+    char *value = s;
+    if (*s == '=')
+    {
+      value = ++s;
+      if (match)
+      {
+        size_t len = decodeURL(s, '&');
+        // close the gap the escapes leave, so the rest of the tail
+        // stays as it was
+        if (value + len != s)
+          memmove(value + len, s, strlen(s) + 1);
+        if (length != NULL)
+          *length = len;
+        return value;
+      }
+      while (*s != 0 && *s != '&')
+        ++s;
+    }
+    else if (match)
+    {
+      if (length != NULL)
+        *length = 0;
+      return value;
+    }
+
+    if (*s == '&')
+      ++s;
+  }
+  return NULL;
+}
+
+// Count one more character found of word, in lower case, when
+// looking for it in a header value.  Its first letter mustn't come
+// up again in it.
+uint8_t WebServer::matchWord(const char *word, uint8_t matched, int ch)
+{
+  if (word[matched] == 0)
+    return matched;
+  ch = lowerCase(ch);
+  if (ch == word[matched])
+    return matched + 1;
+  return (ch == word[0]) ? 1 : 0;
+}
+
+void WebServer::resetConditions()
+{
+#if WEBDUINO_CONDITIONAL_REQUESTS
+  m_conn->conditions = 0;
+  m_conn->ifModifiedSince = 0;
+#endif
+  m_conn->etag = 0;
+  m_conn->lastModified = 0;
+}
+
+#if WEBDUINO_CONDITIONAL_REQUESTS
+
+// Take the entity tag out of an If-None-Match header.  Only tags this
+// server could have sent, 8 hex digits, can match, and only the first
+// one of a list is looked at.
+void WebServer::parseIfNoneMatch(const char *value)
+{
+  m_conn->conditions |= IF_NONE_MATCH;
+  if (value[0] == '*')
+  {
+    m_conn->conditions |= IF_NONE_MATCH_ANY;
+    return;
+  }
+
+  // the weak comparison If-None-Match asks for ignores this
+  if (value[0] == 'W' && value[1] == '/')
+    value += 2;
+  m_conn->ifNoneMatch = parseETag(value);
+}
+
+// Turn an entity tag like "0123abcd" back into the number it was made
+// from; returns 0 if it isn't one this server sends.
+uint32_t WebServer::parseETag(const char *value)
+{
+  if (*value++ != '"')
+    return 0;
+
+  char *end;
+  uint32_t etag = strtoul(value, &end, 16);
+  if (end != value + 8 || *end != '"')
+    return 0;
+  return etag;
+}
+
+// Take the byte range out of a Range header.  Only a single range can
+// be served; with several, the header is ignored.
+void WebServer::parseRange(const char *value)
+{
+  if (strncmp(value, "bytes=", 6) != 0)
+    return;
+  value += 6;
+
+  char *end;
+  uint8_t flags = RANGE;
+  if (*value == '-')
+  {
+    flags |= RANGE_SUFFIX;
+    m_conn->rangeLast = strtoul(value + 1, &end, 10);
+  }
+  else
+  {
+    m_conn->rangeFirst = strtoul(value, &end, 10);
+    if (end == value || *end++ != '-')
+      return;
+    if (*end >= '0' && *end <= '9')
+      m_conn->rangeLast = strtoul(end, &end, 10);
+    else
+      m_conn->rangeLast = 0xFFFFFFFFUL; // up to the end
+  }
+  if (*end != 0 && *end != ' ')
+    return;
+  m_conn->conditions |= flags;
+}
+
+// Take the ETag or date out of an If-Range header.
+void WebServer::parseIfRange(const char *value)
+{
+  m_conn->conditions |= IF_RANGE;
+  if (value[0] == '"' || value[0] == 'W')
+  {
+    // weak tags never match here, and parseETag turns them into 0
+    m_conn->ifRange = parseETag(value);
+  }
+  else
+  {
+    m_conn->conditions |= IF_RANGE_DATE;
+    m_conn->ifRange = parseDate(value);
+  }
+}
+#endif
+
+// Find out from an Accept-Encoding header whether gzip may be sent: it
+// has to be listed, and not with a q of 0, as in "gzip;q=0".
+void WebServer::parseAcceptEncoding(const char *value)
+{
+  while (*value != 0)
+  {
+    while (*value == ' ' || *value == '\t' || *value == ',')
+      ++value;
+    const char *coding = value;
+    while (*value != 0 && *value != ',' && *value != ';' &&
+           *value != ' ' && *value != '\t')
+      ++value;
+    size_t len = value - coding;
+    bool gzip = (len == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+                (len == 6 && strncasecmp(coding, "x-gzip", 6) == 0);
+
+    // of its parameters, only q matters
+    bool refused = false;
+    while (*value != 0 && *value != ',')
+    {
+      if (*value++ != ';')
+        continue;
+      while (*value == ' ' || *value == '\t')
+        ++value;
+      if ((*value == 'q' || *value == 'Q') && value[1] == '=')
+      {
+        // 0, 0.0, 0.00 and 0.000 are all the ways of saying 0
+        value += 2;
+        refused = (*value == '0');
+        if (refused && *++value == '.')
+          while (*++value == '0')
+            ;
+        if (*value >= '1' && *value <= '9')
+          refused = false;
+      }
+    }
+    if (gzip && !refused)
+      m_conn->acceptGzip = true;
+  }
+}
+
+P(monthNames) = "JanFebMarAprMayJunJulAugSepOctNovDec";
+P(dayNames) = "ThuFriSatSunMonTueWed"; // 1 Jan 1970 was a Thursday
+
+// Turn a date like "Sun, 06 Nov 1994 08:49:37 GMT", the format all
+// current clients use, into seconds since 1970; returns 0 if it can't.
+uint32_t WebServer::parseDate(const char *value)
+{
+  const char *p = strchr(value, ',');
+  if (p == NULL)
+    return 0;
+
+  char *end;
+  unsigned day = strtoul(p + 1, &end, 10);
+  while (*end == ' ')
+    ++end;
+  uint8_t month = 0;
+  while (month < 12 && strncmp_P(end, (const char *)monthNames + 3 * month, 3) != 0)
+    ++month;
+  if (month == 12)
+    return 0;
+  unsigned year = strtoul(end + 3, &end, 10);
+  unsigned long hour = strtoul(end, &end, 10);
+  if (*end != ':')
+    return 0;
+  unsigned minute = strtoul(end + 1, &end, 10);
+  if (*end != ':')
+    return 0;
+  unsigned second = strtoul(end + 1, &end, 10);
+  if (year < 1970 || day < 1 || day > 31)
+    return 0;
+
+  return daysFromCivil(year, month + 1, day) * 86400UL +
+         hour * 3600 + minute * 60 + second;
+}
+
+// Count the days from 1 Jan 1970 to a date of the Gregorian calendar.
+uint32_t WebServer::daysFromCivil(unsigned year, unsigned month, unsigned day)
+{
+  // start the year in March, so the leap day comes last
+  if (month <= 2)
+  {
+    --year;
+    month += 12;
+  }
+  uint32_t days = 365UL * year + year / 4 - year / 100 + year / 400;
+  return days + (153 * (month - 3) + 2) / 5 + day - 719469UL;
+}
+
+// Output the ETag and Last-Modified headers declared with notModified.
+void WebServer::printValidators()
+{
+  if (m_conn->etag != 0)
+  {
+    P(etagMsg) = "ETag: \"";
+    printP(etagMsg);
+    printHex(m_conn->etag, 8);
+    write('"');
+    printCRLF();
+  }
+
+  if (m_conn->lastModified != 0)
+  {
+    uint32_t t = m_conn->lastModified;
+    uint32_t days = t / 86400UL;
+    t %= 86400UL;
+
+    // the reverse of daysFromCivil, with years starting in March
+    uint32_t n = days + 719468UL;
+    unsigned year = (4 * n + 3) / 146097;
+    n -= 146097UL * year / 4;
+    unsigned y = (4 * n + 3) / 1461;
+    n -= 1461UL * y / 4;
+    unsigned m = (5 * n + 2) / 153;
+    unsigned day = n - (153 * m + 2) / 5 + 1;
+    uint8_t month = (m < 10) ? m + 2 : m - 10; // counted from January
+    year = 100 * year + y + (m >= 10);
+
+    char date[] = "Last-Modified: Thu, 01 Jan 1970 00:00:00 GMT" CRLF;
+    memcpy_P(date + 15, dayNames + 3 * (days % 7), 3);
+    date[20] = '0' + day / 10;
+    date[21] = '0' + day % 10;
+    memcpy_P(date + 23, monthNames + 3 * month, 3);
+    date[27] = '0' + year / 1000;
+    date[28] = '0' + year / 100 % 10;
+    date[29] = '0' + year / 10 % 10;
+    date[30] = '0' + year % 10;
+    uint8_t fields[3] = { uint8_t(t / 3600), uint8_t(t / 60 % 60), uint8_t(t % 60) };
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+      date[32 + 3 * i] = '0' + fields[i] / 10;
+      date[33 + 3 * i] = '0' + fields[i] % 10;
+    }
+    print(date);
+  }
+}
+
+#if WEBDUINO_NONBLOCKING
+// Take on a client that connected since the last call, if there's a
+// free slot for it.  Clients that don't get one stay queued in the
+// Ethernet chip and are picked up once a slot frees up.
+void WebServer::acceptConnection()
+{
+  Connection *slot = NULL;
+  for (uint8_t i = 0; i < SIZE(m_connections) && slot == NULL; ++i)
+  {
+    if (!m_connections[i].client)
+      slot = &m_connections[i];
+  }
+  if (slot == NULL)
+    return;
+
+#if WEBDUINO_ETHERNET_ACCEPT
+  // each new client is handed over once, so only when there's a slot
+  EthernetClient client = m_server.accept();
+#else
+  // the server reports the lowest numbered socket with something to
+  // read, which can be one we're serving already, like one whose body
+  // is still coming in.  The sockets after it are then looked at the
+  // same way, so that one doesn't hold up the clients behind it.
+  EthernetClient client = m_server.available();
+  uint8_t sock = 0;
+  while (client && serving(client))
+  {
+    client = EthernetClient();
+    for (; sock < MAX_SOCK_NUM && !client; ++sock)
+    {
+      if (EthernetClass::_server_port[sock] == m_port &&
+          EthernetClient(sock).available() > 0)
+        client = EthernetClient(sock);
+    }
+  }
+#endif
+  if (!client)
+    return;
+
+  m_conn = slot;
+  m_conn->client = client;
+#if WEBDUINO_KEEP_ALIVE
+  m_conn->requests = 0;
+  m_conn->skip = 0;
+#endif
+  startRequest();
+}
+
+#if !WEBDUINO_ETHERNET_ACCEPT
+// Tell whether a client has a slot already, or is an event stream or
+// a WebSocket.
+bool WebServer::serving(EthernetClient &client)
+{
+  for (uint8_t i = 0; i < SIZE(m_connections); ++i)
+  {
+    if (m_connections[i].client == client)
+      return true;
+  }
+#if WEBDUINO_EVENT_STREAMS
+  for (uint8_t i = 0; i < SIZE(m_streams); ++i)
+  {
+    if (m_streams[i].client == client)
+      return true;
+  }
+#endif
+#if WEBDUINO_WEBSOCKETS
+  for (uint8_t i = 0; i < SIZE(m_webSockets); ++i)
+  {
+    if (m_webSockets[i].client == client)
+      return true;
+  }
+#endif
+  return false;
+}
+#endif
+
+// Feed the parser whatever part of the request has arrived so far
+// without waiting for more.
 //
-// On return, length contains the amount of space left in request.  If it's
-// less than 0,  the URL was longer than the buffer,  and part of it had to
-// be discarded.
-
-void WebServer::getRequest(WebServer::ConnectionType &type,
-                           char *request, int *length)
-{
-  --*length; // save room for NUL
-
-  type = INVALID;
-
-  // store the HTTP method line of the request
-  if (expect("GET "))
-    type = GET;
-  else if (expect("HEAD "))
-    type = HEAD;
-  else if (expect("POST "))
-    type = POST;
-  else if (expect("PUT "))
-    type = PUT;
-  else if (expect("DELETE "))
-    type = DELETE;
-  else if (expect("PATCH "))
-    type = PATCH;
-
-  // if it doesn't start with any of those, we have an unknown method
-  // so just get out of here
-  else
-    return;
-
-  int ch;
-  while ((ch = read()) != -1)
+// returns true once the request line, the headers and (as far as
+// WEBDUINO_NONBLOCKING_BODY_SIZE allows) the body are there, or
+// once the request turned out to be invalid.
+bool WebServer::parseRequest()
+{
+  while (m_conn->parseState != PARSE_BODY)
   {
-    // stop storing at first space or end of line
-    if (ch == ' ' || ch == '\n' || ch == '\r')
-    {
+    int ch = readInput();
+    if (ch == -1)
       break;
-    }
-    if (*length > 0)
+#if WEBDUINO_SERIAL_DEBUGGING
+    if (ch == '\r')
+      Serial.print("<CR>");
+    else if (ch == '\n')
+      Serial.println("<LF>");
+    else
+      Serial.print((char)ch);
+#endif
+    m_conn->lastActivity = millis();
+#if WEBDUINO_KEEP_ALIVE
+    if (m_conn->skip > 0)
     {
-      *request = ch;
-      ++request;
+      --m_conn->skip;
+      continue;
     }
-    --*length;
+#endif
+    parseRequestChar(ch);
+  }
+
+  if (m_conn->parseState == PARSE_BODY)
+  {
+    // leave the body in the socket for the handler, but don't run
+    // the handler before it can be read without waiting
+    long wanted = m_conn->contentLength;
+    if (wanted > WEBDUINO_NONBLOCKING_BODY_SIZE)
+      wanted = WEBDUINO_NONBLOCKING_BODY_SIZE;
+    if (inputCount() + m_conn->client.available() >= wanted ||
+        !m_conn->client.connected())
+      return true;
+  }
+  else if (!m_conn->client.connected())
+  {
+    // connection lost before the request was complete
+#if WEBDUINO_SERIAL_DEBUGGING
+    Serial.println("*** Connection lost");
+#endif
+    reset();
+    return false;
+  }
+
+  unsigned long timeout = WEBDUINO_READ_TIMEOUT_IN_MS;
+#if WEBDUINO_KEEP_ALIVE
+  // waiting for the next request on a connection that's kept open,
+  // once the last one's body is out of the way
+  if (m_conn->requests > 0 && m_conn->parseState == PARSE_METHOD &&
+      m_conn->requestLen == 0 && m_conn->skip == 0)
+    timeout = WEBDUINO_KEEP_ALIVE_TIMEOUT_IN_MS;
+#endif
+  if (millis() - m_conn->lastActivity > timeout)
+  {
+#if WEBDUINO_SERIAL_DEBUGGING
+    Serial.println("*** Connection timed out");
+#endif
+#if WEBDUINO_METRICS
+    ++m_timeouts;
+#endif
+    reset();
   }
-  // NUL terminate
-  *request = 0;
+  return false;
 }
 
-void WebServer::processHeaders()
-{
-  // look for three things: the Content-Length header, the Authorization
-  // header, and the double-CRLF that ends the headers.
+#endif
 
-  // empty the m_authCredentials before every run of this function.
-  // otherwise users who don't send an Authorization header would be treated
-  // like the last user who tried to authenticate (possibly successful)
-  m_authCredentials[0]=0;
+// Get the request parser ready for a new request.
+void WebServer::startRequest()
+{
+  m_conn->parseState = PARSE_METHOD;
+  m_conn->requestType = INVALID;
+#if WEBDUINO_NONBLOCKING
+  m_conn->lastActivity = millis();
+#endif
+  clearArena();
+  m_conn->requestLen = 0;
+  m_conn->hash = HASH_START;
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+  m_conn->capture = 0;
+#endif
+  m_conn->headerLen = 0;
+  m_conn->contentLength = 0;
+  m_conn->readingContent = false;
+  m_conn->acceptGzip = false;
+#if WEBDUINO_WEBSOCKETS
+  m_conn->upgradeWebSocket = false;
+  m_conn->webSocketVersion = false;
+#endif
+#if WEBDUINO_MULTIPART
+  m_conn->boundaryLen = 0;
+  m_conn->boundary[0] = 0;
+#endif
+  resetConditions();
+  m_pushbackDepth = 0;
+#if WEBDUINO_KEEP_ALIVE
+  m_conn->http11 = false;
+  m_conn->keepAlive = false;
+#endif
+#if WEBDUINO_METRICS
+  m_conn->started = micros();
+  m_conn->bytesIn = 0;
+  m_conn->bytesOut = 0;
+  m_conn->failed = false;
+#endif
+}
 
-  while (1)
+// Advance the request parser by one character of the request.
+void WebServer::parseRequestChar(char ch)
+{
+  switch (m_conn->parseState)
   {
-    if (expect("Content-Length:"))
+  case PARSE_METHOD:
+    // empty lines before a request are skipped, as RFC 7230 asks, for
+    // clients that end a body with an extra CRLF
+    if (m_conn->requestLen == 0 && (ch == '\r' || ch == '\n'))
+      return;
+    // hash the method name until the space; requestLen only counts
+    // the characters so a started request isn't taken for an idle
+    // connection
+    if (ch != ' ')
     {
-      readInt(m_contentLength);
-#if WEBDUINO_SERIAL_DEBUGGING > 1
-      Serial.print("\n*** got Content-Length of ");
-      Serial.print(m_contentLength);
-      Serial.print(" ***");
+#if WEBDUINO_METRICS
+      // the time a request takes is counted from its first character
+      if (m_conn->requestLen == 0)
+        m_conn->started = micros();
 #endif
-      continue;
+      if (m_conn->requestLen < 8)
+      {
+        m_conn->hash = hashChar(m_conn->hash, ch);
+        arenaAdd(ch);
+        ++m_conn->requestLen;
+        return;
+      }
+    }
+    else
+    {
+      ConnectionType type = INVALID;
+      const char *expected = NULL;
+      switch (m_conn->hash)
+      {
+      case hashMethod("GET"):    type = GET;    expected = PSTR("GET");    break;
+      case hashMethod("HEAD"):   type = HEAD;   expected = PSTR("HEAD");   break;
+      case hashMethod("POST"):   type = POST;   expected = PSTR("POST");   break;
+      case hashMethod("PUT"):    type = PUT;    expected = PSTR("PUT");    break;
+      case hashMethod("DELETE"): type = DELETE; expected = PSTR("DELETE"); break;
+      case hashMethod("PATCH"):  type = PATCH;  expected = PSTR("PATCH");  break;
+      }
+
+      // like header names, the method has to be the one its hash
+      // points to; it's collected in the arena before the URL
+      if (expected != NULL && strcmp_P(arenaString(), expected) == 0)
+        m_conn->requestType = type;
+      arenaDrop();
+    }
+    m_conn->hash = HASH_START;
+    m_conn->requestLen = 0;
+    // with an unknown method there's no point in reading any further,
+    // so treat the request as complete
+    m_conn->parseState = (m_conn->requestType == INVALID) ? PARSE_BODY : PARSE_URL;
+    return;
+
+  case PARSE_URL:
+    // stop storing at first space or end of line
+    if (ch == ' ' || ch == '\r' || ch == '\n')
+    {
+      arenaKeep();
+      m_conn->parseState = (ch == '\n') ? PARSE_HEADER_NAME : PARSE_VERSION;
+      m_conn->headerLen = 0;
+      return;
     }
+    arenaAdd(ch);
+    ++m_conn->requestLen;
+    return;
 
-    if (expect("Authorization:"))
+  case PARSE_VERSION:
+#if WEBDUINO_KEEP_ALIVE
+    // HTTP/1.1 clients expect the connection to stay open by default
+    if (ch == '\n')
     {
-      readHeader(m_authCredentials,51);
-#if WEBDUINO_SERIAL_DEBUGGING > 1
-      Serial.print("\n*** got Authorization: of ");
-      Serial.print(m_authCredentials);
-      Serial.print(" ***");
-#endif
-      continue;
+      m_conn->http11 = strcmp(arenaString(), "HTTP/1.1") == 0;
+      m_conn->keepAlive = m_conn->http11;
+      arenaDrop();
     }
+    else if (ch != '\r' && ch != ' ')
+      arenaAdd(ch);
+#endif
+    if (ch == '\n')
+      m_conn->parseState = PARSE_HEADER_NAME;
+    return;
 
-    if (expect(CRLF CRLF))
+  case PARSE_HEADER_NAME:
+    if (ch == '\r')
+      return;
+    if (ch == '\n')
+    {
+      // an empty line ends the headers
+      if (m_conn->headerLen == 0)
+        m_conn->parseState = PARSE_BODY;
+      m_conn->headerLen = 0;
+      m_conn->hash = HASH_START;
+      arenaDrop();
+      return;
+    }
+    if (ch == ':')
     {
-      m_readingContent = true;
+      // names too long to be checked can't be any we look for
+      if (m_conn->headerLen > WEBDUINO_HEADER_NAME_LENGTH)
+        m_conn->hash = HASH_START;
+      parseHeaderName();
+      arenaDrop();
+      m_conn->parseState = PARSE_HEADER_VALUE;
+      m_conn->headerLen = 0;
+      m_conn->hash = HASH_START;
       return;
     }
+    m_conn->hash = hashChar(m_conn->hash, lowerCase(ch));
+    if (m_conn->headerLen < WEBDUINO_HEADER_NAME_LENGTH)
+      arenaAdd(ch);
+    if (m_conn->headerLen < 255)
+      ++m_conn->headerLen;
+    return;
 
-    // no expect checks hit, so just absorb a character and try again
-    if (read() == -1)
+  case PARSE_HEADER_VALUE:
+    if (ch == '\r')
+      return;
+    if (ch == '\n')
     {
+      // a length without any digits is as bad as one with others
+      if (m_conn->parseHeader == HEADER_CONTENT_LENGTH && m_conn->matched == 0)
+      {
+        badContentLength();
+        return;
+      }
+#if WEBDUINO_SERIAL_DEBUGGING > 1
+      if (m_conn->parseHeader == HEADER_CONTENT_LENGTH)
+      {
+        Serial.print("\n*** got Content-Length of ");
+        Serial.print(m_conn->contentLength);
+        Serial.print(" ***");
+      }
+      else if (m_conn->parseHeader == HEADER_AUTHORIZATION)
+      {
+        Serial.print("\n*** got Authorization: of ");
+        Serial.print(arenaString());
+        Serial.print(" ***");
+      }
+#endif
+      char *value = arenaString();
+#if WEBDUINO_KEEP_ALIVE
+      if (m_conn->parseHeader == HEADER_CONNECTION)
+      {
+        if (strncasecmp(value, "close", 5) == 0)
+          m_conn->keepAlive = false;
+        else if (strncasecmp(value, "keep-alive", 10) == 0)
+          m_conn->keepAlive = true;
+      }
+#endif
+      if (m_conn->arenaClipped)
+      {
+        // a value cut short could mean something else, like bytes=0-19
+        // for bytes=0-1999, so the header is left out as if not sent
+      }
+#if WEBDUINO_CONDITIONAL_REQUESTS
+      else if (m_conn->parseHeader == HEADER_IF_NONE_MATCH)
+        parseIfNoneMatch(value);
+      else if (m_conn->parseHeader == HEADER_IF_MODIFIED_SINCE)
+        m_conn->ifModifiedSince = parseDate(value);
+      else if (m_conn->parseHeader == HEADER_RANGE)
+        parseRange(value);
+      else if (m_conn->parseHeader == HEADER_IF_RANGE)
+        parseIfRange(value);
+#endif
+      else if (m_conn->parseHeader == HEADER_ACCEPT_ENCODING)
+        parseAcceptEncoding(value);
+#if WEBDUINO_WEBSOCKETS
+      else if (m_conn->parseHeader == HEADER_WEBSOCKET_VERSION)
+        m_conn->webSocketVersion = strncmp(value, "13", 2) == 0 &&
+                                   (value[2] < '0' || value[2] > '9');
+#endif
+
+      // the values the handlers can ask for stay in the arena
+      if (capturing() || m_conn->parseHeader == HEADER_AUTHORIZATION ||
+          m_conn->parseHeader == HEADER_WEBSOCKET_KEY)
+      {
+        // credentials or a key cut short would only be turned down
+        if (m_conn->arenaClipped &&
+            (m_conn->parseHeader == HEADER_AUTHORIZATION ||
+             m_conn->parseHeader == HEADER_WEBSOCKET_KEY))
+          m_conn->headerClipped = true;
+        ArenaIndex at = arenaKeep();
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+        if (m_conn->capture)
+          m_conn->captureAt[m_conn->capture - 1] = at;
+#endif
+        if (m_conn->parseHeader == HEADER_AUTHORIZATION)
+          m_conn->authAt = at;
+#if WEBDUINO_WEBSOCKETS
+        if (m_conn->parseHeader == HEADER_WEBSOCKET_KEY)
+          m_conn->webSocketKeyAt = at;
+#endif
+      }
+      else
+        arenaDrop();
+      m_conn->parseState = PARSE_HEADER_NAME;
+      m_conn->headerLen = 0;
+      return;
+    }
+    // absorb whitespace in front of the value
+    if (m_conn->headerLen == 0 && (ch == ' ' || ch == '\t'))
       return;
+    if (capturing() || m_conn->parseHeader == HEADER_AUTHORIZATION ||
+        m_conn->parseHeader == HEADER_WEBSOCKET_KEY ||
+        m_conn->parseHeader >= HEADER_CONNECTION)
+      arenaAdd(ch);
+    if (m_conn->parseHeader == HEADER_CONTENT_LENGTH)
+    {
+      // the length is digits, which only whitespace may follow; matched
+      // is 1 once there are some and 2 once they're over
+      if (ch == ' ' || ch == '\t')
+        m_conn->matched = 2;
+      else if (ch < '0' || ch > '9' || m_conn->matched == 2 ||
+               m_conn->contentLength > (0x7fffffffL - (ch - '0')) / 10)
+      {
+        badContentLength();
+        return;
+      }
+      else
+      {
+        m_conn->matched = 1;
+        m_conn->contentLength = m_conn->contentLength * 10 + ch - '0';
+      }
+    }
+#if WEBDUINO_MULTIPART
+    else if (m_conn->parseHeader == HEADER_CONTENT_TYPE)
+    {
+      // keep what follows boundary=, without quotes, up to a ;
+      if (m_conn->matched < 9)
+        m_conn->matched = matchWord("boundary=", m_conn->matched, ch);
+      else if (ch == ';')
+        m_conn->matched = 10;
+      else if (m_conn->matched == 9 && ch != '"' &&
+               m_conn->boundaryLen < sizeof(m_conn->boundary) - 1)
+      {
+        m_conn->boundary[m_conn->boundaryLen++] = ch;
+        m_conn->boundary[m_conn->boundaryLen] = 0;
+      }
+    }
+#endif
+#if WEBDUINO_WEBSOCKETS
+    else if (m_conn->parseHeader == HEADER_UPGRADE)
+    {
+      m_conn->matched = matchWord("websocket", m_conn->matched, ch);
+      if (m_conn->matched == 9)
+        m_conn->upgradeWebSocket = true;
+    }
+#endif
+    if (m_conn->headerLen < 255)
+      ++m_conn->headerLen;
+    return;
+  }
+}
+
+// Decide which header the name just hashed belongs to, and whether
+// the application wants its value.
+void WebServer::parseHeaderName()
+{
+  // the name is being collected in the arena.  If there was no room
+  // left for all of it, it can't be checked, and the header is left
+  // out like a value that didn't fit.
+  const char *name = arenaString();
+  bool clipped = m_conn->arenaClipped;
+
+  m_conn->matched = 0;
+#if WEBDUINO_CAPTURE_HEADERS_COUNT
+  m_conn->capture = 0;
+  for (uint8_t i = 0; i < m_captureCount && !clipped; ++i)
+  {
+    if (m_captures[i] == m_conn->hash &&
+        strcasecmp(name, m_captureNames[i]) == 0)
+    {
+      m_conn->capture = i + 1;
+      break;
     }
   }
+#endif
+
+  uint8_t header = HEADER_OTHER;
+  const char *expected = NULL;
+  switch (m_conn->hash)
+  {
+  case hashName("Content-Length"):
+    header = HEADER_CONTENT_LENGTH;
+    expected = PSTR("Content-Length");
+    break;
+  case hashName("Authorization"):
+    header = HEADER_AUTHORIZATION;
+    expected = PSTR("Authorization");
+    break;
+  case hashName("Accept-Encoding"):
+    header = HEADER_ACCEPT_ENCODING;
+    expected = PSTR("Accept-Encoding");
+    break;
+#if WEBDUINO_MULTIPART
+  case hashName("Content-Type"):
+    header = HEADER_CONTENT_TYPE;
+    expected = PSTR("Content-Type");
+    break;
+#endif
+#if WEBDUINO_WEBSOCKETS
+  case hashName("Upgrade"):
+    header = HEADER_UPGRADE;
+    expected = PSTR("Upgrade");
+    break;
+  case hashName("Sec-WebSocket-Key"):
+    header = HEADER_WEBSOCKET_KEY;
+    expected = PSTR("Sec-WebSocket-Key");
+    break;
+  case hashName("Sec-WebSocket-Version"):
+    header = HEADER_WEBSOCKET_VERSION;
+    expected = PSTR("Sec-WebSocket-Version");
+    break;
+#endif
+#if WEBDUINO_CONDITIONAL_REQUESTS
+  case hashName("If-None-Match"):
+    header = HEADER_IF_NONE_MATCH;
+    expected = PSTR("If-None-Match");
+    break;
+  case hashName("If-Modified-Since"):
+    header = HEADER_IF_MODIFIED_SINCE;
+    expected = PSTR("If-Modified-Since");
+    break;
+  case hashName("Range"):
+    header = HEADER_RANGE;
+    expected = PSTR("Range");
+    break;
+  case hashName("If-Range"):
+    header = HEADER_IF_RANGE;
+    expected = PSTR("If-Range");
+    break;
+#endif
+#if WEBDUINO_KEEP_ALIVE
+  case hashName("Connection"):
+    header = HEADER_CONNECTION;
+    expected = PSTR("Connection");
+    break;
+#endif
+  }
+
+  // the hash only tells which header the name can be; a client could
+  // send another name that hashes the same
+  if (expected != NULL && (clipped || strcasecmp_P(name, expected) != 0))
+  {
+    // without its length the body can't be found, and credentials or
+    // a key left out would only be turned down, so those get a 431
+    if (clipped && (header == HEADER_CONTENT_LENGTH ||
+                    header == HEADER_AUTHORIZATION ||
+                    header == HEADER_WEBSOCKET_KEY))
+      m_conn->headerClipped = true;
+    header = HEADER_OTHER;
+  }
+  m_conn->parseHeader = header;
+
+  if (header == HEADER_CONTENT_LENGTH)
+    m_conn->contentLength = 0;
+#if WEBDUINO_MULTIPART
+  else if (header == HEADER_CONTENT_TYPE)
+  {
+    m_conn->boundaryLen = 0;
+    m_conn->boundary[0] = 0;
+  }
+#endif
+}
+
+// Fail a request whose Content-Length isn't a number that fits, as
+// the body can't be told apart from what follows it.  The rest isn't
+// parsed.
+void WebServer::badContentLength()
+{
+  m_conn->contentLength = 0;
+  m_conn->requestType = INVALID;
+  m_conn->parseState = PARSE_BODY;
 }
 
 void WebServer::outputCheckboxOrRadio(const char *element, const char *name,
@@ -1315,6 +6039,269 @@ uint8_t WebServer::available(){
   return m_server.available();
 }
 
+#ifdef __SD_H__
+bool SDFileStore::open(const char *path)
+{
+  m_file = SD.open(path);
+  if (m_file && m_file.isDirectory())
+    m_file.close();
+  return m_file;
+}
+
+void SDFileStore::close()
+{
+  m_file.close();
+}
+
+uint32_t SDFileStore::size()
+{
+  return m_file.size();
+}
+
+bool SDFileStore::seek(uint32_t pos)
+{
+  return m_file.seek(pos);
+}
+
+int SDFileStore::read(uint8_t *buffer, uint16_t len)
+{
+  return m_file.read(buffer, len);
+}
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+PosixFileStore::PosixFileStore(const char *root) :
+  m_root(root),
+  m_file(NULL)
+{
+}
+
+bool PosixFileStore::open(const char *path)
+{
+  char name[256];
+  snprintf(name, sizeof(name), "%s/%s", m_root, path);
+  if (stat(name, &m_stat) != 0 || !S_ISREG(m_stat.st_mode))
+    return false;
+  m_file = fopen(name, "rb");
+  return m_file != NULL;
+}
+
+void PosixFileStore::close()
+{
+  if (m_file != NULL)
+    fclose(m_file);
+  m_file = NULL;
+}
+
+uint32_t PosixFileStore::size()
+{
+  return m_stat.st_size;
+}
+
+uint32_t PosixFileStore::lastModified()
+{
+  return m_stat.st_mtime;
+}
+
+bool PosixFileStore::seek(uint32_t pos)
+{
+  return fseek(m_file, pos, SEEK_SET) == 0;
+}
+
+int PosixFileStore::read(uint8_t *buffer, uint16_t len)
+{
+  return fread(buffer, 1, len, m_file);
+}
+#endif
+
+JsonWriter::JsonWriter(WebServer &server) :
+  m_server(server),
+  m_members(0),
+  m_key(false)
+{
+}
+
+// put a comma in front of everything but the first member of an
+// object or array, and the value after a key
+void JsonWriter::separate()
+{
+  if (m_key)
+    m_key = false;
+  else if (m_members & 1)
+    m_server.write(',');
+  m_members |= 1;
+}
+
+JsonWriter &JsonWriter::begin(char ch)
+{
+  separate();
+  m_server.write(ch);
+  m_members <<= 1;
+  return *this;
+}
+
+JsonWriter &JsonWriter::end(char ch)
+{
+  m_server.write(ch);
+  m_members >>= 1;
+  return *this;
+}
+
+JsonWriter &JsonWriter::beginObject()
+{
+  return begin('{');
+}
+
+JsonWriter &JsonWriter::endObject()
+{
+  return end('}');
+}
+
+JsonWriter &JsonWriter::beginArray()
+{
+  return begin('[');
+}
+
+JsonWriter &JsonWriter::endArray()
+{
+  return end(']');
+}
+
+JsonWriter &JsonWriter::key(const char *name)
+{
+  value(name);
+  m_server.write(':');
+  m_key = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::keyP(const unsigned char *name)
+{
+  valueP(name);
+  m_server.write(':');
+  m_key = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(const char *str)
+{
+  separate();
+  m_server.write('"');
+  // characters that need no escaping go out in runs
+  const char *run = str;
+  for (; *str; ++str)
+  {
+    if ((uint8_t)*str < ' ' || *str == '"' || *str == '\\')
+    {
+      m_server.write((const uint8_t *)run, str - run);
+      writeEscaped(*str);
+      run = str + 1;
+    }
+  }
+  m_server.write((const uint8_t *)run, str - run);
+  m_server.write('"');
+  return *this;
+}
+
+JsonWriter &JsonWriter::valueP(const unsigned char *str)
+{
+  separate();
+  m_server.write('"');
+  char ch;
+  while ((ch = pgm_read_byte(str++)) != 0)
+    writeEscaped(ch);
+  m_server.write('"');
+  return *this;
+}
+
+void JsonWriter::writeEscaped(char ch)
+{
+  static const char hex[] = "0123456789abcdef";
+  if ((uint8_t)ch >= ' ' && ch != '"' && ch != '\\')
+  {
+    m_server.write(ch);
+    return;
+  }
+  m_server.write('\\');
+  switch (ch)
+  {
+  case '"':  m_server.write('"'); break;
+  case '\\': m_server.write('\\'); break;
+  case '\n': m_server.write('n'); break;
+  case '\r': m_server.write('r'); break;
+  case '\t': m_server.write('t'); break;
+  default:
+    m_server.write('u');
+    m_server.write('0');
+    m_server.write('0');
+    m_server.write(hex[ch >> 4]);
+    m_server.write(hex[ch & 15]);
+    break;
+  }
+}
+
+JsonWriter &JsonWriter::value(int number)
+{
+  return value((long)number);
+}
+
+JsonWriter &JsonWriter::value(unsigned int number)
+{
+  return value((unsigned long)number);
+}
+
+JsonWriter &JsonWriter::value(long number)
+{
+  separate();
+  m_server.printInt(number);
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(unsigned long number)
+{
+  separate();
+  m_server.printUInt(number);
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(bool b)
+{
+  P(trueStr) = "true";
+  P(falseStr) = "false";
+  separate();
+  if (b)
+    m_server.printP(trueStr);
+  else
+    m_server.printP(falseStr);
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(double number, uint8_t digits)
+{
+  // only NaN and infinity don't give 0 here
+  if (number - number != 0 ||
+      number > 4294967040.0 || number < -4294967040.0)
+    return null();
+  separate();
+  m_server.print(number, digits);
+  return *this;
+}
+
+JsonWriter &JsonWriter::fixed(long number, uint8_t decimals)
+{
+  separate();
+  m_server.printFixed(number, decimals);
+  return *this;
+}
+
+JsonWriter &JsonWriter::null()
+{
+  P(nullStr) = "null";
+  separate();
+  m_server.printP(nullStr);
+  return *this;
+}
+
 #endif // WEBDUINO_NO_IMPLEMENTATION
 
 #endif // WEBDUINO_H_
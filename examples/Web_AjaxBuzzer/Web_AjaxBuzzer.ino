@@ -1,5 +1,13 @@
 /* Web_Buzzer.pde - example sketch for Webduino library */
 
+/* keep the connection open between the Ajax requests instead of
+ * setting up a new one for each of them */
+#define WEBDUINO_NONBLOCKING 1
+#define WEBDUINO_KEEP_ALIVE 1
+/* and let the page send the slider's value over a WebSocket as it
+ * moves, without a request for each change */
+#define WEBDUINO_WEBSOCKETS 1
+
 #include "SPI.h"
 #include "Ethernet.h"
 #include "WebServer.h"
@@ -27,50 +35,48 @@ int buzzDelay = 0;
 iteration. */
 char toggle = 0;
 
+/* called with each message the page sends on its WebSocket, which
+ * is the new value of the slider */
+void buzzMessage(WebServer &server, uint8_t client, char *data, size_t length, bool binary)
+{
+  buzzDelay = strtoul(data, NULL, 10);
+}
+
+/* the page opens its WebSocket at /buzz/ws.  startWebSocket answers
+ * the handshake and keeps the connection open for buzzMessage */
+void wsCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool)
+{
+  if (!server.startWebSocket(&buzzMessage))
+    server.httpFail();
+}
+
 /* This command is set as the default command for the server.  It
  * handles both GET and POST requests.  For a GET, it returns a simple
  * page with some buttons.  For a POST, it saves the value posted to
  * the buzzDelay variable, affecting the output of the speaker */
-void buzzCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
+void buzzCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool)
 {
   if (type == WebServer::POST)
   {
-    bool repeat;
-    char name[16], value[16];
-    do
+    /* the page posts to a URL like /buzz/?buzz=128.  findParam finds
+     * the parameter right there in the URL, without copying it into a
+     * buffer, or returns NULL if it isn't there. */
+    char *value;
+    if ((value = server.findParam(url_tail, "buzz")) != NULL)
     {
-      /* readPOSTparam returns false when there are no more parameters
-       * to read from the input.  We pass in buffers for it to store
-       * the name and value strings along with the length of those
-       * buffers. */
-      repeat = server.readPOSTparam(name, 16, value, 16);
-
-      /* this is a standard string comparison function.  It returns 0
-       * when there's an exact match.  We're looking for a parameter
-       * named "buzz" here. */
-      if (strcmp(name, "buzz") == 0)
-      {
-	/* use the STRing TO Unsigned Long function to turn the string
-	 * version of the delay number into our integer buzzDelay
-	 * variable */
-        buzzDelay = strtoul(value, NULL, 10);
-      }
-    } while (repeat);
-    
+      /* use the STRing TO Unsigned Long function to turn the string
+       * version of the number into our integer buzzDelay variable */
+      buzzDelay = strtoul(value, NULL, 10);
+    }
+
     // after procesing the POST data, tell the web browser to reload
     // the page using a GET method. 
     server.httpSeeOther(PREFIX);
     return;
   }
 
-  /* for a GET or HEAD, send the standard "it's all OK headers" */
-  server.httpSuccess();
-
-  /* we don't output the body for a HEAD request */
-  if (type == WebServer::GET)
-  {
-    /* store the HTML in program memory using the P macro */
-    P(message) = 
+  /* store the HTML in program memory using the P macro */
+  P(message) = 
 "<!DOCTYPE html><html><head>"
   "<title>Webduino AJAX Buzzer Example</title>"
   "<link href='http://ajax.googleapis.com/ajax/libs/jqueryui/1.8.16/themes/base/jquery-ui.css' rel=stylesheet />"
@@ -79,8 +85,12 @@ void buzzCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
   "<script src='http://ajax.googleapis.com/ajax/libs/jqueryui/1.8.16/jquery-ui.min.js'></script>"
   "<style> #slider { margin: 10px; } </style>"
   "<script>"
-    "function changeBuzz(event, ui) { $('#indicator').text(ui.value); $.post('/buzz', { buzz: ui.value } ); }"
-    "$(document).ready(function(){ $('#slider').slider({min: 0, max:8000, change:changeBuzz}); });"
+    "var ws = window.WebSocket ? new WebSocket('ws://' + location.host + '/buzz/ws') : null;"
+    "function changeBuzz(event, ui) {"
+      "$('#indicator').text(ui.value);"
+      "if (ws && ws.readyState == 1) ws.send(ui.value); else if (event.type == 'slidechange') $.post('/buzz/?buzz=' + ui.value);"
+    "}"
+    "$(document).ready(function(){ $('#slider').slider({min: 0, max:8000, slide:changeBuzz, change:changeBuzz}); });"
   "</script>"
 "</head>"
 "<body style='font-size:62.5%;'>"
@@ -90,6 +100,14 @@ void buzzCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
 "</body>"
 "</html>";
 
+  /* for a GET or HEAD, send the standard "it's all OK headers".  Passing
+   * the length of the page lets the browser keep the connection open
+   * for the Ajax requests that follow. */
+  server.httpSuccess("text/html; charset=utf-8", NULL, sizeof(message) - 1);
+
+  /* we don't output the body for a HEAD request */
+  if (type == WebServer::GET)
+  {
     server.printP(message);
   }
 }
@@ -106,13 +124,16 @@ void setup()
    * http://x.x.x.x/buzz */
   webserver.setDefaultCommand(&buzzCmd);
 
+  /* and the one for the WebSocket, at http://x.x.x.x/buzz/ws */
+  webserver.addCommand("ws", &wsCmd);
+
   /* start the server to wait for connections */
   webserver.begin();
 }
 
 void loop()
 {
-  // process incoming connections one at a time forever
+  // make progress on all incoming connections forever
   webserver.processConnection();
 
   /* every other time through the loop, turn on and off the speaker if
@@ -1,5 +1,14 @@
 /* Web_AjaxRGB.pde - example sketch for Webduino library */
 
+/* keep the connection open between the Ajax requests instead of
+ * setting up a new one for each of them */
+#define WEBDUINO_NONBLOCKING 1
+#define WEBDUINO_KEEP_ALIVE 1
+
+/* and have each page kept told of the color by the server, so all the
+ * pages that are open follow the sliders of any of them */
+#define WEBDUINO_EVENT_STREAMS 2
+
 #include "SPI.h"
 #include "Ethernet.h"
 #include "WebServer.h"
@@ -24,61 +33,48 @@ int red = 0;            //integer for red darkness
 int blue = 0;           //integer for blue darkness
 int green = 0;          //integer for green darkness
 
+/* turn the string version of a number from the URL into a color
+ * value, using the STRing TO Unsigned Long function.  Anyone can send
+ * anything, so it's kept to 0-255. */
+int colorValue(const char *value)
+{
+  unsigned long n = strtoul(value, NULL, 10);
+  return (n > 255) ? 255 : n;
+}
+
 /* This command is set as the default command for the server.  It
  * handles both GET and POST requests.  For a GET, it returns a simple
  * page with some buttons.  For a POST, it saves the value posted to
  * the red/green/blue variable, affecting the output of the speaker */
-void rgbCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
+void rgbCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool)
 {
   if (type == WebServer::POST)
   {
-    bool repeat;
-    char name[16], value[16];
-    do
-    {
-      /* readPOSTparam returns false when there are no more parameters
-       * to read from the input.  We pass in buffers for it to store
-       * the name and value strings along with the length of those
-       * buffers. */
-      repeat = server.readPOSTparam(name, 16, value, 16);
-
-      /* this is a standard string comparison function.  It returns 0
-       * when there's an exact match.  We're looking for a parameter
-       * named red/green/blue here. */
-      if (strcmp(name, "red") == 0)
-      {
-	/* use the STRing TO Unsigned Long function to turn the string
-	 * version of the color strength value into our integer red/green/blue
-	 * variable */
-        red = strtoul(value, NULL, 10);
-      }
-      if (strcmp(name, "green") == 0)
-      {
-        green = strtoul(value, NULL, 10);
-      }
-      if (strcmp(name, "blue") == 0)
-      {
-        blue = strtoul(value, NULL, 10);
-      }
-    } while (repeat);
-    
+    /* the page posts to a URL like /rgb/?red=128.  findParam finds
+     * the parameter right there in the URL, without copying it into a
+     * buffer, or returns NULL if it isn't there. */
+    char *value;
+    if ((value = server.findParam(url_tail, "red")) != NULL)
+      red = colorValue(value);
+    if ((value = server.findParam(url_tail, "green")) != NULL)
+      green = colorValue(value);
+    if ((value = server.findParam(url_tail, "blue")) != NULL)
+      blue = colorValue(value);
+
+    /* push the new color to the open pages, as an "rgb" event */
+    char rgb[12];
+    snprintf(rgb, sizeof(rgb), "%d,%d,%d", red, green, blue);
+    server.sendEvent("rgb", rgb);
+
     // after procesing the POST data, tell the web browser to reload
     // the page using a GET method. 
     server.httpSeeOther(PREFIX);
-//    Serial.print(name);
-//    Serial.println(value);
 
     return;
   }
 
-  /* for a GET or HEAD, send the standard "it's all OK headers" */
-  server.httpSuccess();
-
-  /* we don't output the body for a HEAD request */
-  if (type == WebServer::GET)
-  {
-    /* store the HTML in program memory using the P macro */
-    P(message) = 
+  /* store the HTML in program memory using the P macro */
+  P(message) = 
 "<!DOCTYPE html><html><head>"
   "<title>Webduino AJAX RGB Example</title>"
   "<link href='http://ajax.googleapis.com/ajax/libs/jqueryui/1.8.16/themes/base/jquery-ui.css' rel=stylesheet />"
@@ -88,13 +84,17 @@ void rgbCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
   "<script>"
 
 // change color on mouse up, not while sliding (causes much less traffic to the Arduino):
-//    "function changeRGB(event, ui) { var id = $(this).attr('id'); if (id == 'red') $.post('/rgb', { red: ui.value } ); if (id == 'green') $.post('/rgb', { green: ui.value } ); if (id == 'blue') $.post('/rgb', { blue: ui.value } ); } "
+//    "function changeRGB(event, ui) { if (!event.originalEvent) return; var id = $(this).attr('id'); if (id == 'red') $.post('/rgb/?red=' + ui.value); if (id == 'green') $.post('/rgb/?green=' + ui.value); if (id == 'blue') $.post('/rgb/?blue=' + ui.value); } "
 //    "$(document).ready(function(){ $('#red, #green, #blue').slider({min: 0, max:255, change:changeRGB}); });"
 
 // change color on slide and mouse up (causes more traffic to the Arduino):
-    "function changeRGB(event, ui) { jQuery.ajaxSetup({timeout: 110}); /*not to DDoS the Arduino, you might have to change this to some threshold value that fits your setup*/ var id = $(this).attr('id'); if (id == 'red') $.post('/rgb', { red: ui.value } ); if (id == 'green') $.post('/rgb', { green: ui.value } ); if (id == 'blue') $.post('/rgb', { blue: ui.value } ); } "
+    "function changeRGB(event, ui) { if (!event.originalEvent) return; /*moved by an event from the server*/ jQuery.ajaxSetup({timeout: 110}); /*not to DDoS the Arduino, you might have to change this to some threshold value that fits your setup*/ var id = $(this).attr('id'); if (id == 'red') $.post('/rgb/?red=' + ui.value); if (id == 'green') $.post('/rgb/?green=' + ui.value); if (id == 'blue') $.post('/rgb/?blue=' + ui.value); } "
     "$(document).ready(function(){ $('#red, #green, #blue').slider({min: 0, max:255, change:changeRGB, slide:changeRGB}); });"
 
+// move the sliders when the color is changed, here or on another page:
+    "var events = new EventSource('/rgb/events'); "
+    "events.addEventListener('rgb', function(e) { var rgb = e.data.split(','); $('#red').slider('value', rgb[0]); $('#green').slider('value', rgb[1]); $('#blue').slider('value', rgb[2]); });"
+
   "</script>"
 "</head>"
 "<body style='font-size:62.5%;'>"
@@ -104,10 +104,27 @@ void rgbCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
 "</body>"
 "</html>";
 
+  /* for a GET or HEAD, send the standard "it's all OK headers".  Passing
+   * the length of the page lets the browser keep the connection open
+   * for the Ajax requests that follow. */
+  server.httpSuccess("text/html; charset=utf-8", NULL, sizeof(message) - 1);
+
+  /* we don't output the body for a HEAD request */
+  if (type == WebServer::GET)
+  {
     server.printP(message);
   }
 }
 
+/* the pages keep /rgb/events open, to get the events sent when the
+ * color changes.  The connection is left open for them after this
+ * returns. */
+void eventsCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
+{
+  if (!server.startEventStream())
+    server.httpServerError();
+}
+
 void setup()
 {
   pinMode(RED_PIN, OUTPUT);
@@ -122,6 +139,7 @@ void setup()
   /* register our default command (activated with the request of
    * http://x.x.x.x/rgb */
   webserver.setDefaultCommand(&rgbCmd);
+  webserver.addCommand("events", &eventsCmd);
 
   /* start the server to wait for connections */
   webserver.begin();
@@ -129,7 +147,7 @@ void setup()
 
 void loop()
 {
-  // process incoming connections one at a time forever
+  // make progress on all incoming connections forever
   webserver.processConnection();
 //  Serial.print(red);
 //  Serial.print(" ");
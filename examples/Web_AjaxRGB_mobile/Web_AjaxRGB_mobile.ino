@@ -29,45 +29,28 @@ int green = 0;          //integer for green darkness
  * handles both GET and POST requests.  For a GET, it returns a simple
  * page with some buttons.  For a POST, it saves the value posted to
  * the red/green/blue variable, affecting the output of the speaker */
-void rgbCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
+void rgbCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool)
 {
   if (type == WebServer::POST)
   {
-    bool repeat;
-    char name[16], value[16];
-    do
+    /* the page posts to a URL like /rgb/?red=128.  findParam finds
+     * the parameter right there in the URL, without copying it into a
+     * buffer, or returns NULL if it isn't there. */
+    char *value;
+    if ((value = server.findParam(url_tail, "red")) != NULL)
     {
-      /* readPOSTparam returns false when there are no more parameters
-       * to read from the input.  We pass in buffers for it to store
-       * the name and value strings along with the length of those
-       * buffers. */
-      repeat = server.readPOSTparam(name, 16, value, 16);
-
-      /* this is a standard string comparison function.  It returns 0
-       * when there's an exact match.  We're looking for a parameter
-       * named red/green/blue here. */
-      if (strcmp(name, "red") == 0)
-      {
-	/* use the STRing TO Unsigned Long function to turn the string
-	 * version of the color strength value into our integer red/green/blue
-	 * variable */
-        red = strtoul(value, NULL, 10);
-      }
-      if (strcmp(name, "green") == 0)
-      {
-        green = strtoul(value, NULL, 10);
-      }
-      if (strcmp(name, "blue") == 0)
-      {
-        blue = strtoul(value, NULL, 10);
-      }
-    } while (repeat);
-    
+      /* use the STRing TO Unsigned Long function to turn the string
+       * version of the number into our integer red variable */
+      red = strtoul(value, NULL, 10);
+    }
+    if ((value = server.findParam(url_tail, "green")) != NULL)
+      green = strtoul(value, NULL, 10);
+    if ((value = server.findParam(url_tail, "blue")) != NULL)
+      blue = strtoul(value, NULL, 10);
+
     // after procesing the POST data, tell the web browser to reload
     // the page using a GET method. 
     server.httpSeeOther(PREFIX);
-//    Serial.print(name);
-//    Serial.println(value);
 
     return;
   }
@@ -89,7 +72,7 @@ void rgbCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
   "<style> body, .ui-page { background: black; } .ui-body { padding-bottom: 1.5em; } div.ui-slider { width: 88%; } #red, #green, #blue { display: block; margin: 10px; } #red { background: #f00; } #green { background: #0f0; } #blue { background: #00f; } </style>"
   "<script>"
 // causes the Arduino to hang quite frequently (more often than Web_AjaxRGB.pde), probably due to the different event triggering the ajax requests
-    "$(document).ready(function(){ $('#red, #green, #blue').slider; $('#red, #green, #blue').bind( 'change', function(event, ui) { jQuery.ajaxSetup({timeout: 110}); /*not to DDoS the Arduino, you might have to change this to some threshold value that fits your setup*/ var id = $(this).attr('id'); var strength = $(this).val(); if (id == 'red') $.post('/rgb', { red: strength } ); if (id == 'green') $.post('/rgb', { green: strength } ); if (id == 'blue') $.post('/rgb', { blue: strength } ); });});"
+    "$(document).ready(function(){ $('#red, #green, #blue').slider; $('#red, #green, #blue').bind( 'change', function(event, ui) { jQuery.ajaxSetup({timeout: 110}); /*not to DDoS the Arduino, you might have to change this to some threshold value that fits your setup*/ var id = $(this).attr('id'); var strength = $(this).val(); if (id == 'red') $.post('/rgb/?red=' + strength); if (id == 'green') $.post('/rgb/?green=' + strength); if (id == 'blue') $.post('/rgb/?blue=' + strength); });});"
   "</script>"
 "</head>"
 "<body>"
@@ -9,6 +9,8 @@
  *
  * This URL brings up a display of the values READ on digital pins 0-9
  * and analog pins 0-5.  This is done with a call to defaultCmd.
+ * /json has them as JSON, and a PUT of a document like {"d9": 1} to
+ * it sets the pins.
  * 
  * 
  * http://host/form
@@ -45,8 +47,25 @@ WebServer webserver(PREFIX, 80);
 // commands are functions that get called by the webserver framework
 // they can read any posted data from client, and they output to server
 
+// called by readJson for each value in the document that was PUT
+void jsonPin(WebServer &server, const char *path, WebServer::JsonType type, const char *value)
+{
+  if (path[0] == 'd' && type == WebServer::JSON_NUMBER)
+    digitalWrite(atoi(path + 1), atoi(value));
+}
+
 void jsonCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete)
 {
+  if (type == WebServer::PUT)
+  {
+    // the body is parsed as it comes in, without keeping it in memory
+    if (server.readJson(&jsonPin))
+      server.httpNoContent();
+    else
+      server.httpFail();
+    return;
+  }
+
   if (type == WebServer::POST)
   {
     server.httpFail();
@@ -59,24 +78,26 @@ void jsonCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail,
   if (type == WebServer::HEAD)
     return;
 
-  int i;    
-  server << "{ ";
+  // the writer puts in the quotes and commas
+  JsonWriter json(server);
+  char name[4];
+  int i;
+  json.beginObject();
   for (i = 0; i <= 9; ++i)
   {
     // ignore the pins we use to talk to the Ethernet chip
-    int val = digitalRead(i);
-    server << "\"d" << i << "\": " << val << ", ";
+    name[0] = 'd';
+    itoa(i, name + 1, 10);
+    json.key(name).value(digitalRead(i));
   }
 
   for (i = 0; i <= 5; ++i)
   {
-    int val = analogRead(i);
-    server << "\"a" << i << "\": " << val;
-    if (i != 5)
-      server << ", ";
+    name[0] = 'a';
+    itoa(i, name + 1, 10);
+    json.key(name).value(analogRead(i));
   }
-  
-  server << " }";
+  json.endObject();
 }
 
 void outputPins(WebServer &server, WebServer::ConnectionType type, bool addControls = false)
@@ -165,6 +186,15 @@ void defaultCmd(WebServer &server, WebServer::ConnectionType type, char *url_tai
   outputPins(server, type, false);  
 }
 
+/* the URLs handled besides the root page.  The table is sorted by
+ * URL and kept in program memory, so it takes no RAM and is searched
+ * quickly however many entries it has. */
+static constexpr WebServer::Route routes[] PROGMEM = {
+  { "form", &formCmd },
+  { "json", &jsonCmd },
+};
+WEBDUINO_ROUTES_SORTED(routes);
+
 void setup()
 {
   // set pins 0-8 for digital input
@@ -176,8 +206,7 @@ void setup()
   webserver.begin();
 
   webserver.setDefaultCommand(&defaultCmd);
-  webserver.addCommand("json", &jsonCmd);
-  webserver.addCommand("form", &formCmd);
+  webserver.setRoutes(routes, SIZE(routes));
 }
 
 void loop()
@@ -0,0 +1,56 @@
+/* Web_Files.ino - Webduino example serving the files of an SD card */
+
+#include "SPI.h"
+#include "Ethernet.h"
+/* SD.h has to come before WebServer.h for SDFileStore to be there */
+#include "SD.h"
+#include "WebServer.h"
+
+/* CHANGE THIS TO YOUR OWN UNIQUE VALUE.  The MAC number should be
+ * different from any other devices on your network or you'll have
+ * problems receiving packets. */
+static uint8_t mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
+
+/* CHANGE THIS TO MATCH YOUR HOST NETWORK. */
+static uint8_t ip[] = { 192, 168, 1, 210 };
+
+/* the chip select pin of the SD card; 4 on the Arduino Ethernet
+ * shield */
+#define SD_CS_PIN 4
+
+#define PREFIX ""
+WebServer webserver(PREFIX, 80);
+
+/* the files on the card are served at /files/..., so the card's
+ * LOG.TXT is at http://host/files/LOG.TXT and /files/ shows its
+ * INDEX.HTM.  Files are sent with a content type guessed from their
+ * extension, and clients can fetch parts of them with Range headers,
+ * e.g. to resume an interrupted download. */
+SDFileStore sdFiles;
+
+void indexCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
+{
+  server.httpSuccess();
+  if (type != WebServer::HEAD)
+  {
+    P(indexMsg) = "<h1>Files</h1><a href='" PREFIX "/files/'>Browse the SD card</a>";
+    server.printP(indexMsg);
+  }
+}
+
+void setup()
+{
+  Ethernet.begin(mac, ip);
+
+  /* the Ethernet chip shares the SPI bus with the card */
+  SD.begin(SD_CS_PIN);
+
+  webserver.setDefaultCommand(&indexCmd);
+  webserver.serveFiles("files", &sdFiles);
+  webserver.begin();
+}
+
+void loop()
+{
+  webserver.processConnection();
+}
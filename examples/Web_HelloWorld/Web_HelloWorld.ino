@@ -63,9 +63,6 @@ void setup()
 
 void loop()
 {
-  char buff[64];
-  int len = 64;
-
   /* process incoming connections one at a time forever */
-  webserver.processConnection(buff, &len);
+  webserver.processConnection();
 }
@@ -1,20 +1,14 @@
 /* Web_Image.pde - example sketch for Webduino library */
 /* For webduino version 1.2 */
 
-/* DISCLAIMER -- the Webduino server can only handle one web connection
- * at a time.  Because of this, loading the root page on this sketch may
- * not correctly show the LED icon if the browser starts requesting that
- * picture before the page has finished loading.
- *
- * This problem should be reduced greatly once the Ethernet library
- * has been modified to do proper packet buffering.  With the library
- * in Arduino 15, each character is sent in its own TCP/IP packet.
- * This is very inefficient and means that it takes much longer to
- * send a web page than it should.  When this bug is fixed, the web
- * server will have sent its last data and closed the connection by
- * the time the client reads the HTML, so it's ready to handle the
- * image request.
+/* The page and the image it shows are requested by the browser over
+ * separate connections.  By default the Webduino server handles one
+ * web connection at a time, so the image request has to wait until the
+ * page has been sent.  Defining WEBDUINO_NONBLOCKING lets the server
+ * work on as many connections at once as the Ethernet chip has sockets,
+ * so the page, the image and the favicon are all served together.
  */
+#define WEBDUINO_NONBLOCKING 1
 
 #include "SPI.h"
 #include "Ethernet.h"
@@ -85,7 +79,7 @@ void imageCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail,
   }
 
   /* for a GET or HEAD, send the standard "it's all OK headers" but identify our data as a PNG file */
-  server.httpSuccess("image/png");
+  server.httpSuccess("image/png", NULL, sizeof(ledData));
 
   /* we don't output the body for a HEAD request */
   if (type == WebServer::GET)
@@ -112,6 +106,6 @@ void setup()
 
 void loop()
 {
-  // process incoming connections one at a time forever
+  // make progress on all incoming connections forever
   webserver.processConnection();
 }
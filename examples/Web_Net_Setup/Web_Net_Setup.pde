@@ -67,6 +67,8 @@ For more informations about EEPROMAnything.h look at http://playground.arduino.c
 //#define DEBUG  //uncomment for serial debug output
 #define USE_SYSTEM_LIBRARY //comment out if you want to save some space (about 1 Byte). You wouldn't see uptime and free RAM if it's commented out.
 #define SERIAL_BAUD 9600
+// the setup form is sent back with all its fields in the URL
+#define WEBDUINO_ARENA_SIZE 256
 
 
 #include "SPI.h" // new include
@@ -334,52 +336,45 @@ P(Page_end) = "</body></html>";
 P(Http400) = "HTTP 400 - BAD REQUEST";
 P(Index) = "<h1>index.html</h1><br>This is your main site!<br>The code is found in the indexHTML() function.<br>You can add more sites if you need. Please see the well documented source code.<br><br>Use the following link to setup the network.<br><a href=\"setupNet.html\">NETWORK SETUP</a>";
 
-P(Form_eth_start) = "<FORM action=\"setupNet.html\" method=\"get\">";
-P(Form_end) = "<FORM>";
-P(Form_input_send) = "<INPUT type=\"submit\" value=\"Set config\">";
-
-P(Form_input_text_start) = "<input type=\"text\" name=\"";
-P(Form_input_value)  = "\" value=\"";
-P(Form_input_size2) = "\" maxlength=\"2\" size=\"2";
-P(Form_input_size3) = "\" maxlength=\"3\" size=\"3";
-P(Form_input_end) = "\">\n";
-
-P(MAC) = "MAC address: ";
-P(IP) = "IP address: ";
-P(SUBNET) = "Subnet: ";
-P(GW) = "GW address: ";
-P(DNS_SERVER) = "DNS server: ";
-P(WEB_PORT) = "Webserver port (1-65535): ";
-P(DHCP_ACTIVE) = "Use DHCP: ";
-P(DHCP_REFRESH) = "Renew interval for DHCP in minutes (1 - 255): ";
-
-P(Form_cb) = "<input type=\"radio\" name=\"23\" value=\"";
-P(Form_cb_checked) = " checked ";
-P(Form_cb_on) = ">On";
-P(Form_cb_off) = ">Off";
-
-P(br) = "<br>\n";
-
-P(table_start) = "<table>";
-P(table_tr_start) = "<tr>";
-P(table_tr_end) = "</tr>";
-P(table_td_start) = "<td>";
-P(table_td_end) = "</td>";
-P(table_end) = "</table>";
-
-P(Config_set) = "<font size=\"6\" color=\"red\">New configuration stored! <br>Please turn off and on your Arduino or use the reset button!</font><br>";
-
-P(DHCP_STATE_TIME) = "DHCP last renew timestamp (sec)";
-P(DHCP_STATE) = "DHCP renew return code (sec)";
-
-
-P(UPTIME) = "Uptime: ";
+/* The setup page is a template: renderTemplate sends the text in between
+in whole runs, and calls setupNetSlot for each {{name}} placeholder to
+print what goes there.  WEBDUINO_TEMPLATE has the compiler find the
+placeholders, in Setup_pageSlots. */
+WEBDUINO_TEMPLATE(Setup_page,
+  "<FORM action=\"setupNet.html\" method=\"get\">"
+  "{{config_set}}"
+  "<table>"
+  "<tr><td>MAC address: </td><td>{{mac}}</td></tr>"
+  "<tr><td>IP address: </td><td>{{ip}}</td></tr>"
+  "<tr><td>Subnet: </td><td>{{subnet}}</td></tr>"
+  "<tr><td>GW address: </td><td>{{gateway}}</td></tr>"
+  "<tr><td>DNS server: </td><td>{{dns_server}}</td></tr>"
+  "<tr><td>Webserver port (1-65535): </td>"
+  "<td><input type=\"text\" name=\"22\" value=\"{{port}}\">\n</td></tr>"
+  "<tr><td>Use DHCP: </td><td>"
+  "<input type=\"radio\" name=\"23\" value=\"0\"{{dhcp_off}}>Off"
+  "<input type=\"radio\" name=\"23\" value=\"1\"{{dhcp_on}}>On</td></tr>"
+  "<tr><td>Renew interval for DHCP in minutes (1 - 255): </td>"
+  "<td><input type=\"text\" name=\"24\" value=\"{{dhcp_refresh}}\" maxlength=\"3\" size=\"3\">\n</td></tr>"
+  "{{dhcp_status}}"
+  "{{system}}"
+  "</table>"
+  "<INPUT type=\"submit\" value=\"Set config\">"
+  "<FORM>");
+
+WEBDUINO_TEMPLATE(Dhcp_status,
+  "<tr><td>DHCP renew return code (sec)</td><td>{{dhcp_state}}</td></tr>"
+  "<tr><td>DHCP last renew timestamp (sec)</td><td>{{dhcp_renew}}</td></tr>");
 
 #ifdef USE_SYSTEM_LIBRARY
-P(RAM_1) = "RAM (byte): ";
-P(RAM_2) = " free of ";
+WEBDUINO_TEMPLATE(System_status,
+  "<tr><td>Uptime: </td><td>{{uptime}}</td></tr>"
+  "<tr><td>RAM (byte): {{ram_free}} free of {{ram_size}}</td></tr>");
 #endif
 
+P(Config_set) = "<font size=\"6\" color=\"red\">New configuration stored! <br>Please turn off and on your Arduino or use the reset button!</font><br>";
+P(Checked) = " checked ";
+
 /* This creates an pointer to instance of the webserver. */
 WebServer * webserver;
 
@@ -419,6 +414,91 @@ void indexHTML(WebServer &server, WebServer::ConnectionType type, char *url_tail
 * Parameters are simple numbers. The name of the parameter is converted to an int with the atoi function.
 * This saves some code for setting the MAC and IP addresses.
 */
+boolean params_present;
+
+/**
+* printInputs() function
+* Prints the text inputs for the bytes of an address, named with the
+* numbers from first on.
+*/
+void printInputs(WebServer &server, byte first, byte *values, byte count, boolean hex)
+{
+  for (byte a = 0; a < count; a++) {
+    if (hex)
+      server.printf(F("<input type=\"text\" name=\"%d\" value=\"%X\" maxlength=\"2\" size=\"2\">\n"), first + a, values[a]);
+    else
+      server.printf(F("<input type=\"text\" name=\"%d\" value=\"%d\" maxlength=\"3\" size=\"3\">\n"), first + a, values[a]);
+  }
+}
+
+/**
+* setupNetSlot() function
+* Prints the current value of a placeholder of the setup page.
+*/
+void setupNetSlot(WebServer &server, uint32_t slot)
+{
+  switch (slot) {
+    case WebServer::slot("config_set"):
+      if (params_present)
+        server.printP(Config_set);
+      break;
+    case WebServer::slot("mac"):
+      printInputs(server, 0, eeprom_config.mac, 6, true);
+      break;
+    case WebServer::slot("ip"):
+      printInputs(server, 6, eeprom_config.ip, 4, false);
+      break;
+    case WebServer::slot("subnet"):
+      printInputs(server, 10, eeprom_config.subnet, 4, false);
+      break;
+    case WebServer::slot("gateway"):
+      printInputs(server, 14, eeprom_config.gateway, 4, false);
+      break;
+    case WebServer::slot("dns_server"):
+      printInputs(server, 18, eeprom_config.dns_server, 4, false);
+      break;
+    case WebServer::slot("port"):
+      server.printUInt(eeprom_config.webserverPort);
+      break;
+    case WebServer::slot("dhcp_off"):
+      if (eeprom_config.use_dhcp != 1)
+        server.printP(Checked);
+      break;
+    case WebServer::slot("dhcp_on"):
+      if (eeprom_config.use_dhcp == 1)
+        server.printP(Checked);
+      break;
+    case WebServer::slot("dhcp_refresh"):
+      server.printUInt(eeprom_config.dhcp_refresh_minutes);
+      break;
+    case WebServer::slot("dhcp_status"):
+      // templates can be nested
+      if (eeprom_config.use_dhcp == 1)
+        server.renderTemplate(Dhcp_status, Dhcp_statusSlots, &setupNetSlot);
+      break;
+    case WebServer::slot("dhcp_state"):
+      server.printUInt(dhcp_state);
+      break;
+    case WebServer::slot("dhcp_renew"):
+      server.printUInt(last_dhcp_renew / 1000);
+      break;
+#ifdef USE_SYSTEM_LIBRARY
+    case WebServer::slot("system"):
+      server.renderTemplate(System_status, System_statusSlots, &setupNetSlot);
+      break;
+    case WebServer::slot("uptime"):
+      server.print(sys.uptime());
+      break;
+    case WebServer::slot("ram_free"):
+      server.print(sys.ramFree());
+      break;
+    case WebServer::slot("ram_size"):
+      server.print(sys.ramSize());
+      break;
+#endif
+  }
+}
+
 #define NAMELEN 5
 #define VALUELEN 7
 void setupNetHTML(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete)
@@ -426,9 +506,10 @@ void setupNetHTML(WebServer &server, WebServer::ConnectionType type, char *url_t
   URLPARAM_RESULT rc;
   char name[NAMELEN];
   char value[VALUELEN];
-  boolean params_present = false;
   byte param_number = 0;
 
+  params_present = false;
+
   /* this line sends the standard "we're all OK" headers back to the
      browser */
   server.httpSuccess();
@@ -505,202 +586,8 @@ void setupNetHTML(WebServer &server, WebServer::ConnectionType type, char *url_t
   }
 
   //print the form
-  server.printP(Form_eth_start);
-  
-  if(params_present==true) {
-     server.printP(Config_set);
-  }
-    
-  server.printP(table_start);
-  
-  // print the current MAC
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(MAC);
-  server.printP(table_td_end);
-  server.printP(table_td_start);
-  for (int a=0;a<6;a++) {
-    server.printP(Form_input_text_start);
-    server.print(a);
-    server.printP(Form_input_value);
-    server.print(eeprom_config.mac[a],HEX);
-    server.printP(Form_input_size2);    
-    server.printP(Form_input_end);
-  }
-  server.printP(table_td_end);
-  server.printP(table_tr_end);
-
-  // print the current IP
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(IP);
-  server.printP(table_td_end);
-  server.printP(table_td_start);    
-  for (int a=0;a<4;a++) {
-    server.printP(Form_input_text_start);
-    server.print(a+6);
-    server.printP(Form_input_value);
-    server.print(eeprom_config.ip[a]);
-    server.printP(Form_input_size3);
-    server.printP(Form_input_end);
-  }
-  server.printP(table_td_end);
-  server.printP(table_tr_end);
-  
-
-  // print the current SUBNET
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(SUBNET);
-  server.printP(table_td_end);
-  server.printP(table_td_start); 
-  for (int a=0;a<4;a++) {
-    server.printP(Form_input_text_start);
-    server.print(a+10);
-    server.printP(Form_input_value);
-    server.print(eeprom_config.subnet[a]);
-    server.printP(Form_input_size3);
-    server.printP(Form_input_end);
-  }
-  server.printP(table_td_end);
-  server.printP(table_tr_end);
-
-  // print the current GATEWAY
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(GW);
-  server.printP(table_td_end);
-  server.printP(table_td_start); 
-  for (int a=0;a<4;a++) {
-    server.printP(Form_input_text_start);
-    server.print(a+14);
-    server.printP(Form_input_value);
-    server.print(eeprom_config.gateway[a]);
-    server.printP(Form_input_size3);
-    server.printP(Form_input_end);
-  }
-  server.printP(table_td_end);
-  server.printP(table_tr_end);
-
-  // print the current DNS-SERVER
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(DNS_SERVER);
-  server.printP(table_td_end);
-  server.printP(table_td_start); 
-  for (int a=0;a<4;a++) {
-    server.printP(Form_input_text_start);
-    server.print(a+18);
-    server.printP(Form_input_value);
-    server.print(eeprom_config.dns_server[a]);
-    server.printP(Form_input_size3);
-    server.printP(Form_input_end);
-  }
-  server.printP(table_td_end);
-  server.printP(table_tr_end);
-
-  
-  // print the current webserver port
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(WEB_PORT);
-  server.printP(table_td_end);
-  server.printP(table_td_start);
-  server.printP(Form_input_text_start);
-  server.print(22);
-  server.printP(Form_input_value);
-  server.print(eeprom_config.webserverPort);
-  server.printP(Form_input_end);
-  server.printP(table_td_end);
-  server.printP(table_tr_end);
-  
-  //print the current DHCP config
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(DHCP_ACTIVE);
-  server.printP(table_td_end);
-  server.printP(table_td_start);
-  server.printP(Form_cb);
-  server.print("0\"");
-   if(eeprom_config.use_dhcp != 1) {
-    server.printP(Form_cb_checked);
-  }
-  server.printP(Form_cb_off);   
-  
-  server.printP(Form_cb);
-  server.print("1\"");
-  if(eeprom_config.use_dhcp == 1) {
-    server.printP(Form_cb_checked);
-  }
-  server.printP(Form_cb_on);   
-  server.printP(table_td_end);
-  server.printP(table_tr_end);
-  
-  //print the current DHCP renew time
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(DHCP_REFRESH);
-  server.printP(table_td_end);
-  server.printP(table_td_start);
-  server.printP(Form_input_text_start);
-  server.print(24);
-  server.printP(Form_input_value);
-  server.print(eeprom_config.dhcp_refresh_minutes);
-  server.printP(Form_input_size3);
-  server.printP(Form_input_end);
-  server.printP(table_td_end);
-  server.printP(table_tr_end);
-
-  //print DHCP status
-  if(eeprom_config.use_dhcp == 1) {
-    server.printP(table_tr_start);
-    server.printP(table_td_start);	
-    server.printP(DHCP_STATE);
-    server.printP(table_td_end);
-    server.printP(table_td_start);
-    server.print(dhcp_state);
-    server.printP(table_td_end);
-    server.printP(table_tr_end);
-	 
-    server.printP(table_tr_start);
-    server.printP(table_td_start);	
-    server.printP(DHCP_STATE_TIME);
-    server.printP(table_td_end);
-    server.printP(table_td_start);
-    server.print(last_dhcp_renew/1000);
-    server.printP(table_td_end);
-    server.printP(table_tr_end);
-  }
-  
-  #ifdef USE_SYSTEM_LIBRARY
-  //print uptime
-  server.printP(table_tr_start);
-  server.printP(table_td_start);	
-  server.printP(UPTIME);
-  server.printP(table_td_end);
-  server.printP(table_td_start);
-  server.print(sys.uptime());
-  server.printP(table_td_end);
-  server.printP(table_tr_end); 
-
-  server.printP(table_tr_start);
-  server.printP(table_td_start);
-  server.printP(RAM_1);	
-  server.print(sys.ramFree());
-  server.printP(RAM_2);
-  server.print(sys.ramSize());
-  server.printP(table_td_end);
-  server.printP(table_tr_end); 
-  #endif
-  
-  server.printP(table_end);
-  
-  //print the send button
-  server.printP(Form_input_send);    
-  server.printP(Form_end);
-  
+  server.renderTemplate(Setup_page, Setup_pageSlots, &setupNetSlot);
 
-  
   server.printP(Page_end);
 
 }
@@ -777,9 +664,6 @@ void loop()
   // renew DHCP lease
   renewDHCP(eeprom_config.dhcp_refresh_minutes);
 
-  char buff[200];
-  int len = 200;
-
   /* process incoming connections one at a time forever */
-  webserver->processConnection(buff, &len);
+  webserver->processConnection();
 }
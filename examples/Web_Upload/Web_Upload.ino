@@ -0,0 +1,110 @@
+/* Web_Upload.ino - Webduino example saving uploaded files on an SD card */
+
+/* readMultipart has to be switched on before including WebServer.h */
+#define WEBDUINO_MULTIPART 1
+
+#include "SPI.h"
+#include "Ethernet.h"
+#include "SD.h"
+#include "WebServer.h"
+
+/* CHANGE THIS TO YOUR OWN UNIQUE VALUE.  The MAC number should be
+ * different from any other devices on your network or you'll have
+ * problems receiving packets. */
+static uint8_t mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
+
+/* CHANGE THIS TO MATCH YOUR HOST NETWORK. */
+static uint8_t ip[] = { 192, 168, 1, 210 };
+
+/* the chip select pin of the SD card; 4 on the Arduino Ethernet
+ * shield */
+#define SD_CS_PIN 4
+
+#define PREFIX ""
+WebServer webserver(PREFIX, 80);
+
+/* the file being written and how much went into it */
+File upload;
+unsigned long uploadSize;
+
+/* called by readMultipart with the headers of each part of the form,
+ * then with its data a piece at a time as it arrives, so the file is
+ * never held in RAM as a whole */
+void uploadPart(WebServer &server, WebServer::MultipartEvent event,
+                const char *data, size_t length)
+{
+  char filename[13];
+
+  switch (event)
+  {
+  case WebServer::MULTIPART_HEADER:
+    /* the file input's part says where the file came from in its
+     * Content-Disposition header; 8.3 names only on the card */
+    if (strncasecmp(data, "Content-Disposition:", 20) == 0 &&
+        WebServer::headerParam(data, "filename", filename, sizeof(filename)) &&
+        filename[0])
+    {
+      SD.remove(filename);
+      upload = SD.open(filename, FILE_WRITE);
+      uploadSize = 0;
+    }
+    break;
+
+  case WebServer::MULTIPART_DATA:
+    if (upload)
+    {
+      upload.write((const uint8_t *)data, length);
+      uploadSize += length;
+    }
+    break;
+
+  case WebServer::MULTIPART_END:
+    if (upload)
+      upload.close();
+    break;
+  }
+}
+
+void uploadCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
+{
+  if (type == WebServer::POST)
+  {
+    uploadSize = 0;
+    bool complete = server.readMultipart(&uploadPart);
+    if (upload)
+      upload.close();
+
+    server.httpSuccess();
+    server.printf(F("<p>%s: %lu bytes</p>"),
+                  complete ? "Stored" : "Upload failed", uploadSize);
+    return;
+  }
+
+  server.httpSuccess();
+  if (type != WebServer::HEAD)
+  {
+    P(uploadForm) =
+      "<h1>Upload a file to the SD card</h1>"
+      "<form action='" PREFIX "/' method='post' enctype='multipart/form-data'>"
+      "<input type='file' name='file'/> "
+      "<input type='submit' value='Upload'/>"
+      "</form>";
+    server.printP(uploadForm);
+  }
+}
+
+void setup()
+{
+  Ethernet.begin(mac, ip);
+
+  /* the Ethernet chip shares the SPI bus with the card */
+  SD.begin(SD_CS_PIN);
+
+  webserver.setDefaultCommand(&uploadCmd);
+  webserver.begin();
+}
+
+void loop()
+{
+  webserver.processConnection();
+}
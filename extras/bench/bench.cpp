@@ -0,0 +1,266 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil;  c-file-style: "k&r"; c-basic-offset: 2; -*-
+
+   Webduino benchmark, built for a PC with the stand-ins for the
+   Arduino core and the Ethernet library in extras/host.  From the top
+   of the library:
+
+     g++ -O2 -std=gnu++11 -Iextras/host -I. extras/bench/bench.cpp -o webduino_bench
+     ./webduino_bench [requests]
+
+   Options go on the g++ command line, to see what they cost or save:
+   -DWEBDUINO_OUTPUT_BUFFER_SIZE=2048, or -DWEBDUINO_NONBLOCKING=1
+   -DWEBDUINO_KEEP_ALIVE=1, and so on.
+
+   Each workload is a request like one of the examples gets, served
+   that many times (100000 by default) after a round to warm up.  For
+   each the rate, the time a request takes, and the bytes and socket
+   writes of a response are printed; on a board every write to the
+   socket costs several SPI transfers, so fewer is better.  It exits
+   with 1 if a response doesn't have the status it should.
+*/
+
+#include <Arduino.h>
+#include <Ethernet.h>
+#include "WebServer.h"
+
+WebServer webserver("", 80);
+
+// what a browser sends along with every request.  The requests are
+// HTTP/1.0 ones, so the server closes the connection after each.
+#define BROWSER_HEADERS \
+  "Host: 192.168.1.210\r\n" \
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n" \
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n" \
+  "Accept-Language: en-US,en;q=0.5\r\n" \
+  "Accept-Encoding: gzip, deflate\r\n" \
+  "DNT: 1\r\n"
+
+/* Web_Parms: a form posted to parsed.html, which lists the
+ * parameters of the URL and of the body */
+P(Page_start) = "<html><head><title>Web_Parms_1 Version 0.1</title></head><body>\n";
+P(Page_end) = "</body></html>";
+P(Post_head) = "<h1>POST to ";
+P(Parsed_head) = "parsed.html requested.</h1><br>\n";
+P(Good_tail_begin) = "URL tail = '";
+P(Tail_end) = "'<br>\n";
+P(Parsed_tail_begin) = "URL parameters:<br>\n";
+P(Parsed_item_separator) = " = '";
+P(Params_end) = "End of parameters<br>\n";
+P(Post_params_begin) = "Parameters sent by POST:<br>\n";
+
+void parsedCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete)
+{
+  char name[32];
+  char value[32];
+
+  server.httpSuccess();
+  server.printP(Page_start);
+  server.printP(Post_head);
+  server.printP(Parsed_head);
+  server.printP(Good_tail_begin);
+  server.print(url_tail);
+  server.printP(Tail_end);
+
+  server.printP(Parsed_tail_begin);
+  while (strlen(url_tail))
+  {
+    if (server.nextURLparam(&url_tail, name, sizeof(name), value, sizeof(value)) == URLPARAM_EOS)
+      server.printP(Params_end);
+    else
+    {
+      server.print(name);
+      server.printP(Parsed_item_separator);
+      server.print(value);
+      server.printP(Tail_end);
+    }
+  }
+
+  server.printP(Post_params_begin);
+  while (server.readPOSTparam(name, sizeof(name), value, sizeof(value)))
+  {
+    server.print(name);
+    server.printP(Parsed_item_separator);
+    server.print(value);
+    server.printP(Tail_end);
+  }
+  server.printP(Page_end);
+}
+
+/* Web_AjaxRGB: a slider posts its value in the URL in the
+ * background, and gets sent back to the page */
+int red, green, blue;
+
+void rgbCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool)
+{
+  char *value;
+  if ((value = server.findParam(url_tail, "red")) != NULL)
+    red = strtoul(value, NULL, 10);
+  if ((value = server.findParam(url_tail, "green")) != NULL)
+    green = strtoul(value, NULL, 10);
+  if ((value = server.findParam(url_tail, "blue")) != NULL)
+    blue = strtoul(value, NULL, 10);
+  server.httpSeeOther("/rgb");
+}
+
+/* Web_Image: a small PNG from program memory */
+P(ledData) = {
+  0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+  0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x10, 0x08, 0x02, 0x00, 0x00, 0x00, 0x90, 0x91, 0x68,
+  0x36, 0x00, 0x00, 0x00, 0x01, 0x73, 0x52, 0x47, 0x42, 0x00, 0xae, 0xce, 0x1c, 0xe9, 0x00, 0x00,
+  0x00, 0x04, 0x67, 0x41, 0x4d, 0x41, 0x00, 0x00, 0xb1, 0x8f, 0x0b, 0xfc, 0x61, 0x05, 0x00, 0x00,
+  0x00, 0x20, 0x63, 0x48, 0x52, 0x4d, 0x00, 0x00, 0x7a, 0x26, 0x00, 0x00, 0x80, 0x84, 0x00, 0x00,
+  0xfa, 0x00, 0x00, 0x00, 0x80, 0xe8, 0x00, 0x00, 0x75, 0x30, 0x00, 0x00, 0xea, 0x60, 0x00, 0x00,
+  0x3a, 0x98, 0x00, 0x00, 0x17, 0x70, 0x9c, 0xba, 0x51, 0x3c, 0x00, 0x00, 0x00, 0x18, 0x74, 0x45,
+  0x58, 0x74, 0x53, 0x6f, 0x66, 0x74, 0x77, 0x61, 0x72, 0x65, 0x00, 0x50, 0x61, 0x69, 0x6e, 0x74,
+  0x2e, 0x4e, 0x45, 0x54, 0x20, 0x76, 0x33, 0x2e, 0x33, 0x36, 0xa9, 0xe7, 0xe2, 0x25, 0x00, 0x00,
+  0x00, 0x57, 0x49, 0x44, 0x41, 0x54, 0x38, 0x4f, 0x95, 0x52, 0x5b, 0x0a, 0x00, 0x30, 0x08, 0x6a,
+  0xf7, 0x3f, 0xf4, 0x1e, 0x14, 0x4d, 0x6a, 0x30, 0x8d, 0x7d, 0x0d, 0x45, 0x2d, 0x87, 0xd9, 0x34,
+  0x71, 0x36, 0x41, 0x7a, 0x81, 0x76, 0x95, 0xc2, 0xec, 0x3f, 0xc7, 0x8e, 0x83, 0x72, 0x90, 0x43,
+  0x11, 0x10, 0xc4, 0x12, 0x50, 0xb6, 0xc7, 0xab, 0x96, 0xd0, 0xdb, 0x5b, 0x41, 0x5c, 0x6a, 0x0b,
+  0xfd, 0x57, 0x28, 0x5b, 0xc2, 0xfd, 0xb2, 0xa1, 0x33, 0x28, 0x45, 0xd0, 0xee, 0x20, 0x5c, 0x9a,
+  0xaf, 0x93, 0xd6, 0xbc, 0xdb, 0x25, 0x56, 0x61, 0x01, 0x17, 0x12, 0xae, 0x53, 0x3e, 0x66, 0x32,
+  0xba, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+};
+
+void imageCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
+{
+  server.httpSuccess("image/png", NULL, sizeof(ledData));
+  if (type == WebServer::GET)
+    server.writeP(ledData, sizeof(ledData));
+}
+
+/* Web_Demo: a status page with the pins, polled by a dashboard.  With
+ * -DWEBDUINO_RESPONSE_CACHE=1024 it is rendered once every half a
+ * second, and sent again as it is in between. */
+void statusCmd(WebServer &server, WebServer::ConnectionType type, char *, bool)
+{
+  server.cacheResponse(500);
+  server.httpSuccess();
+  if (type == WebServer::HEAD)
+    return;
+
+  server.printP(Page_start);
+  server.print("<h1>Digital Pins</h1><p>");
+  for (int i = 0; i <= 9; ++i)
+    server.printf(F("Digital %d: %S<br/>"), i, digitalRead(i) ? F("HIGH") : F("LOW"));
+  server.print("</p><h1>Analog Pins</h1><p>");
+  for (int i = 0; i <= 5; ++i)
+    server.printf(F("Analog %d: %d<br/>"), i, analogRead(i));
+  server.print("</p>");
+  server.printP(Page_end);
+}
+
+struct Workload
+{
+  const char *name;
+  const char *request;
+  const char *status;  // what the response has to start with
+};
+
+static const Workload workloads[] = {
+  { "form POST",
+    "POST /parsed.html?page=2&sort=name HTTP/1.0\r\n"
+    BROWSER_HEADERS
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 39\r\n"
+    "\r\n"
+    "name=Webduino&led=on&level=128&mode=pwm",
+    "200" },
+  { "ajax POST",
+    "POST /rgb?red=212 HTTP/1.0\r\n"
+    BROWSER_HEADERS
+    "X-Requested-With: XMLHttpRequest\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n",
+    "303" },
+  { "status GET",
+    "GET /status HTTP/1.0\r\n"
+    BROWSER_HEADERS
+    "\r\n",
+    "200" },
+  { "png GET",
+    "GET /led.png HTTP/1.0\r\n"
+    BROWSER_HEADERS
+    "\r\n",
+    "200" },
+  // URLs without a command get the failure command, a 400 by default
+  { "unknown URL",
+    "GET /missing.html HTTP/1.0\r\n"
+    BROWSER_HEADERS
+    "\r\n",
+    "400" },
+};
+
+// Have the server answer one request.
+//
+// returns false if it didn't, or with the wrong status
+static bool serve(const Workload &workload, unsigned long &sent,
+                  unsigned long &writes)
+{
+  int sock = Loopback::connect(workload.request);
+  if (sock < 0)
+    return false;
+
+  // the whole request is there at once, but the non-blocking mode
+  // may take more than one call to get through it
+  LoopbackSocket &s = Loopback::socket(sock);
+  for (int calls = 0; s.open; ++calls)
+  {
+    if (calls == 100)
+    {
+      // give up on the connection, as a client would
+      s.open = false;
+      return false;
+    }
+    webserver.processConnection();
+  }
+
+  sent += s.sent;
+  writes += s.writes;
+  // the status code follows "HTTP/1.x "
+  return strncmp(s.head + 9, workload.status, 3) == 0;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long requests = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000;
+  if (requests == 0)
+    requests = 1;
+
+  webserver.addCommand("parsed.html", &parsedCmd);
+  webserver.addCommand("rgb", &rgbCmd);
+  webserver.addCommand("led.png", &imageCmd);
+  webserver.addCommand("status", &statusCmd);
+  webserver.begin();
+
+  printf("%-12s %10s %10s %10s %10s\n",
+         "workload", "req/s", "ns/req", "bytes/req", "writes/req");
+
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i)
+  {
+    const Workload &workload = workloads[i];
+    unsigned long sent = 0;
+    unsigned long writes = 0;
+    bool served = true;
+
+    for (unsigned long n = 0; n < requests / 10; ++n)
+      served = serve(workload, sent, writes) && served;
+
+    sent = 0;
+    writes = 0;
+    unsigned long start = micros();
+    for (unsigned long n = 0; n < requests; ++n)
+      served = serve(workload, sent, writes) && served;
+    unsigned long us = micros() - start;
+    if (us == 0)
+      us = 1;
+
+    printf("%-12s %10.0f %10.0f %10.1f %10.1f%s\n", workload.name,
+           requests * 1e6 / us, us * 1e3 / requests,
+           (double)sent / requests, (double)writes / requests,
+           served ? "" : "  WRONG RESPONSE");
+    ok = ok && served;
+  }
+  return ok ? 0 : 1;
+}
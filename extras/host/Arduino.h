@@ -0,0 +1,125 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil;  c-file-style: "k&r"; c-basic-offset: 2; -*-
+
+   Stand-in for the Arduino core, with just what Webduino and its
+   examples use, so the library can be built and measured on a PC.
+   Pin functions do nothing and the clock is the computer's.
+*/
+
+#ifndef ARDUINO_H_STANDIN
+#define ARDUINO_H_STANDIN
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <avr/pgmspace.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+
+// The clock functions have C linkage, like the core's.  millis()
+// reads the coarse clock, which is good enough for timeouts and much
+// cheaper; the server asks for the time for every character it reads.
+extern "C" inline unsigned long micros()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+extern "C" inline unsigned long millis()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
+
+inline void delay(unsigned long) {}
+inline void delayMicroseconds(unsigned int) {}
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return LOW; }
+inline void analogWrite(uint8_t, int) {}
+inline int analogRead(uint8_t) { return 0; }
+inline void tone(uint8_t, unsigned int, unsigned long = 0) {}
+inline void noTone(uint8_t) {}
+
+// strings in program memory are ordinary strings here
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+// Print as the core has it: everything ends up in the two write
+// functions, and classes that can send a block at once override the
+// second one.
+class Print
+{
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--)
+      n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char *str)
+    { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+
+  size_t print(const __FlashStringHelper *str)
+    { return write((const char *)str); }
+  size_t print(const char *str) { return write(str); }
+  size_t print(char ch) { return write((uint8_t)ch); }
+  size_t print(unsigned char number, int base = DEC)
+    { return print((unsigned long)number, base); }
+  size_t print(int number, int base = DEC)
+    { return print((long)number, base); }
+  size_t print(unsigned int number, int base = DEC)
+    { return print((unsigned long)number, base); }
+  size_t print(long number, int base = DEC)
+  {
+    if (number < 0 && base == DEC)
+      return print('-') + print((unsigned long)-number, base);
+    return print((unsigned long)number, base);
+  }
+  size_t print(unsigned long number, int base = DEC)
+  {
+    char buf[8 * sizeof(long) + 1];
+    char *str = buf + sizeof(buf) - 1;
+    *str = 0;
+    do
+    {
+      unsigned digit = number % base;
+      *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+      number /= base;
+    } while (number);
+    return write(str);
+  }
+  size_t print(double number, int digits = 2)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*f", digits, number);
+    return write(buf);
+  }
+
+  size_t println() { return write("\r\n"); }
+  template<class T> size_t println(T value)
+    { return print(value) + println(); }
+  template<class T> size_t println(T value, int format)
+    { return print(value, format) + println(); }
+};
+
+#endif
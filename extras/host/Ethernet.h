@@ -0,0 +1,200 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil;  c-file-style: "k&r"; c-basic-offset: 2; -*-
+
+   Stand-in for the Ethernet library that connects the server to the
+   program itself.  The program plays the clients: it hands a request
+   to Loopback::connect, the server reads it from memory on its next
+   processConnection, and what the server sends back is counted rather
+   than kept.  It follows the API of Ethernet 2, and uses its include
+   guard so WebServer.h takes it for that version.
+*/
+
+#ifndef ethernet_h_
+#define ethernet_h_
+
+#include <Arduino.h>
+
+#define MAX_SOCK_NUM 4
+
+class IPAddress
+{
+public:
+  IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0)
+    { m_address[0] = a; m_address[1] = b; m_address[2] = c; m_address[3] = d; }
+  IPAddress(const uint8_t *address) { memcpy(m_address, address, 4); }
+  uint8_t operator[](int index) const { return m_address[index]; }
+
+private:
+  uint8_t m_address[4];
+};
+
+// the client's end of a connection
+struct LoopbackSocket
+{
+  const char *request;  // what the client sends, all at once
+  size_t length;
+  size_t received;      // how much of it the server has read
+  bool open;            // until the server stops the connection
+  unsigned long sent;   // bytes the server wrote
+  unsigned long writes; // and how many writes that took
+  bool accepted;        // whether the server has been handed it
+  char head[16];        // the first bytes of the response
+};
+
+class Loopback
+{
+public:
+  // Connect to the server on a free socket and send request, which
+  // has to stay around until the server is done with it.
+  //
+  // returns the socket, or -1 if all are in use
+  static int connect(const char *request, size_t length)
+  {
+    for (int sock = 0; sock < MAX_SOCK_NUM; ++sock)
+    {
+      LoopbackSocket &s = socket(sock);
+      if (s.open)
+        continue;
+      memset(&s, 0, sizeof(s));
+      s.request = request;
+      s.length = length;
+      s.open = true;
+      return sock;
+    }
+    return -1;
+  }
+  static int connect(const char *request)
+    { return connect(request, strlen(request)); }
+
+  static LoopbackSocket &socket(int sock)
+  {
+    static LoopbackSocket sockets[MAX_SOCK_NUM];
+    return sockets[sock];
+  }
+};
+
+class EthernetClient : public Print
+{
+public:
+  EthernetClient() : m_sock(-1) {}
+  explicit EthernetClient(int sock) : m_sock(sock) {}
+
+  int available()
+  {
+    if (m_sock < 0)
+      return 0;
+    LoopbackSocket &s = Loopback::socket(m_sock);
+    return s.length - s.received;
+  }
+
+  int read()
+  {
+    uint8_t ch;
+    return read(&ch, 1) == 1 ? ch : -1;
+  }
+
+  int read(uint8_t *buffer, size_t size)
+  {
+    int count = available();
+    if (count == 0)
+      return -1;
+    if ((size_t)count > size)
+      count = size;
+    LoopbackSocket &s = Loopback::socket(m_sock);
+    memcpy(buffer, s.request + s.received, count);
+    s.received += count;
+    return count;
+  }
+
+  int peek()
+  {
+    if (available() == 0)
+      return -1;
+    LoopbackSocket &s = Loopback::socket(m_sock);
+    return (uint8_t)s.request[s.received];
+  }
+
+  virtual size_t write(uint8_t ch) { return write(&ch, 1); }
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    if (m_sock < 0)
+      return 0;
+    LoopbackSocket &s = Loopback::socket(m_sock);
+    for (size_t i = 0; i < size && s.sent + i < sizeof(s.head) - 1; ++i)
+      s.head[s.sent + i] = buffer[i];
+    s.sent += size;
+    ++s.writes;
+    return size;
+  }
+  using Print::write;
+
+  void flush() {}
+
+  void stop()
+  {
+    if (m_sock >= 0)
+      Loopback::socket(m_sock).open = false;
+    m_sock = -1;
+  }
+
+  uint8_t connected()
+  {
+    return m_sock >= 0 && Loopback::socket(m_sock).open;
+  }
+
+  operator bool() { return m_sock >= 0; }
+  bool operator==(const EthernetClient &other) const
+    { return m_sock == other.m_sock; }
+  bool operator!=(const EthernetClient &other) const
+    { return m_sock != other.m_sock; }
+
+private:
+  int m_sock;
+};
+
+class EthernetServer
+{
+public:
+  EthernetServer(uint16_t port) {}
+  void begin() {}
+
+  // a client that has sent something not read yet
+  EthernetClient available()
+  {
+    for (int sock = 0; sock < MAX_SOCK_NUM; ++sock)
+    {
+      LoopbackSocket &s = Loopback::socket(sock);
+      if (s.open && s.received < s.length)
+        return EthernetClient(sock);
+    }
+    return EthernetClient();
+  }
+
+  // a client that has connected since the last call
+  EthernetClient accept()
+  {
+    for (int sock = 0; sock < MAX_SOCK_NUM; ++sock)
+    {
+      LoopbackSocket &s = Loopback::socket(sock);
+      if (s.open && !s.accepted)
+      {
+        s.accepted = true;
+        return EthernetClient(sock);
+      }
+    }
+    return EthernetClient();
+  }
+};
+
+class EthernetClass
+{
+public:
+  int begin(uint8_t *mac) { return 1; }
+  void begin(uint8_t *mac, IPAddress ip, IPAddress dns = IPAddress(),
+             IPAddress gateway = IPAddress(), IPAddress subnet = IPAddress()) {}
+  int maintain() { return 0; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+};
+
+static EthernetClass Ethernet __attribute__((unused));
+
+#endif
@@ -0,0 +1,2 @@
+// the stand-ins for all of the Ethernet library are in Ethernet.h
+#include <Ethernet.h>
@@ -0,0 +1,3 @@
+// Stand-in for the SPI library, which the Ethernet library needs on a
+// board but nothing does here.
+#include <Arduino.h>